@@ -0,0 +1,226 @@
+#define _GNU_SOURCE
+
+#include "buffer.h"
+#include "util.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MIN_CAPACITY 256
+
+char *buffer_reserve(buffer *b, size_t count)
+{
+    if (b->start + b->len + count <= b->cap)
+        return b->data + b->start + b->len;
+    if (b->len + count <= b->cap && b->start >= b->len)
+    {
+        // sliding the pending bytes back is enough, and cheap
+        memcpy(b->data, b->data + b->start, b->len);
+        b->start = 0;
+        return b->data + b->len;
+    }
+    memmove(b->data, b->data + b->start, b->len);
+    b->start = 0;
+    if (b->len + count > b->cap)
+    {
+        size_t cap = b->cap ? 2 * b->cap : MIN_CAPACITY;
+        while (cap < b->len + count)
+            cap *= 2;
+        if (!(b->data = realloc(b->data, cap)))
+            ERR("realloc");
+        b->cap = cap;
+    }
+    return b->data + b->len;
+}
+
+void buffer_append(buffer *b, const void *data, size_t count)
+{
+    memcpy(buffer_reserve(b, count), data, count);
+    b->len += count;
+}
+
+void buffer_consume(buffer *b, size_t count)
+{
+    b->start += count;
+    b->len -= count;
+    if (!b->len)
+        b->start = 0;
+}
+
+void buffer_clear(buffer *b)
+{
+    b->start = b->len = 0;
+}
+
+void buffer_free(buffer *b)
+{
+    free(b->data);
+    memset(b, 0, sizeof(*b));
+}
+
+ssize_t buffer_flush(buffer *b, int fd)
+{
+    while (b->len)
+    {
+        ssize_t count = TEMP_FAILURE_RETRY(write(fd, b->data + b->start, b->len));
+        if (count < 0)
+        {
+            if (EAGAIN == errno)
+                break;
+            if (errno != EPIPE && errno != ECONNRESET)
+                ERR("write");
+            buffer_clear(b);
+            return -1;
+        }
+        buffer_consume(b, count);
+    }
+    return b->len;
+}
+
+void reader_init(reader *r, size_t limit)
+{
+    memset(r, 0, sizeof(*r));
+    r->limit = limit;
+}
+
+void reader_reset(reader *r)
+{
+    buffer_clear(&r->in);
+    r->scanned = 0;
+    r->skip = 0;
+}
+
+void reader_free(reader *r)
+{
+    buffer_free(&r->in);
+    r->scanned = 0;
+    r->skip = 0;
+}
+
+ssize_t reader_fill(reader *r, int fd)
+{
+    // room for a whole line and the start of the next one
+    size_t room = r->limit + 1;
+    ssize_t count = TEMP_FAILURE_RETRY(read(fd, buffer_reserve(&r->in, room), room));
+    if (count > 0)
+        r->in.len += count;
+    return count;
+}
+
+int reader_ready(reader *r)
+{
+    for (;;)
+    {
+        char *data = r->in.data + r->in.start;
+        char *newline = memchr(data + r->scanned, '\n', r->in.len - r->scanned);
+        if (newline && !r->skip)
+            return 1;
+        if (newline)
+        {
+            // the end of a line that was too long, dropped with it
+            buffer_consume(&r->in, newline - data + 1);
+            r->scanned = 0;
+            r->skip = 0;
+            continue;
+        }
+        r->scanned = r->in.len;
+        if (r->in.len > r->limit)
+        {
+            // too long to be a line: drop it, and its rest once it comes
+            buffer_clear(&r->in);
+            r->scanned = 0;
+            r->skip = 1;
+        }
+        return 0;
+    }
+}
+
+char *reader_line(reader *r)
+{
+    if (!reader_ready(r))
+        return NULL;
+    char *data = r->in.data + r->in.start;
+    char *newline = memchr(data + r->scanned, '\n', r->in.len - r->scanned);
+    buffer_consume(&r->in, newline - data + 1);
+    r->scanned = 0;
+    *newline = 0;
+    return data;
+}
+
+// A free block is linked through the header of its cache line before it.
+static void **block_link(void *block)
+{
+    return (void **)((char *)block - CACHE_LINE);
+}
+
+void pool_init(pool *p, size_t size, int shared)
+{
+    memset(p, 0, sizeof(*p));
+    p->size = size;
+    p->shared = shared;
+    if (shared && pthread_mutex_init(&p->mutex, NULL))
+        ERR("pthread_mutex_init");
+}
+
+void *pool_take(pool *p)
+{
+    if (p->shared)
+        pthread_mutex_lock(&p->mutex);
+    void *block = p->free;
+    if (block)
+    {
+        p->free = *block_link(block);
+        --p->available;
+    }
+    if (p->shared)
+        pthread_mutex_unlock(&p->mutex);
+    return block;
+}
+
+void *pool_alloc(pool *p)
+{
+    size_t size = CACHE_LINE + ((p->size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1));
+    char *memory = aligned_alloc(CACHE_LINE, size);
+    if (!memory)
+        ERR("aligned_alloc");
+    memset(memory, 0, size);
+    if (p->shared)
+        pthread_mutex_lock(&p->mutex);
+    ++p->allocated;
+    if (p->shared)
+        pthread_mutex_unlock(&p->mutex);
+    return memory + CACHE_LINE;
+}
+
+void *pool_get(pool *p)
+{
+    void *block = pool_take(p);
+    return block ? block : pool_alloc(p);
+}
+
+void pool_put(pool *p, void *block)
+{
+    if (p->shared)
+        pthread_mutex_lock(&p->mutex);
+    *block_link(block) = p->free;
+    p->free = block;
+    ++p->available;
+    if (p->shared)
+        pthread_mutex_unlock(&p->mutex);
+}
+
+void pool_destroy(pool *p, void (*release)(void *block))
+{
+    while (p->free)
+    {
+        void *block = p->free;
+        p->free = *block_link(block);
+        if (release)
+            release(block);
+        free((char *)block - CACHE_LINE);
+    }
+    if (p->shared)
+        pthread_mutex_destroy(&p->mutex);
+}
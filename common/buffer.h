@@ -0,0 +1,76 @@
+#ifndef COMMON_BUFFER_H
+#define COMMON_BUFFER_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define CACHE_LINE 64
+
+// Growable byte buffer; the pending bytes are data[start, start + len).
+// Consumed bytes are only moved out of the way when room is needed.
+typedef struct
+{
+    char *data;
+    size_t start, len, cap;
+} buffer;
+
+// Makes room for at least count more bytes after the pending ones.
+char *buffer_reserve(buffer *b, size_t count);
+void buffer_append(buffer *b, const void *data, size_t count);
+void buffer_consume(buffer *b, size_t count);
+// Drops the pending bytes and keeps the memory.
+void buffer_clear(buffer *b);
+void buffer_free(buffer *b);
+
+// Writes as much of the buffer as a non-blocking fd takes. Returns the
+// number of bytes left, or -1 if the connection is broken.
+ssize_t buffer_flush(buffer *b, int fd);
+
+// Non-blocking reader of newline-terminated lines. A line longer than
+// limit is dropped up to its newline.
+typedef struct
+{
+    buffer in;
+    size_t limit;
+    size_t scanned;  // pending bytes known to hold no newline
+    int skip;
+} reader;
+
+void reader_init(reader *r, size_t limit);
+// Keeps the memory, so that a recycled reader does not allocate again.
+void reader_reset(reader *r);
+void reader_free(reader *r);
+// One read. Returns the number of bytes read, 0 at EOF, or -1 with errno
+// set, EAGAIN included.
+ssize_t reader_fill(reader *r, int fd);
+// Returns 1 if a complete line is buffered.
+int reader_ready(reader *r);
+// Returns the next complete line without its newline, or NULL. The line
+// stays valid until the next call on the reader.
+char *reader_line(reader *r);
+
+// Pool of blocks of one size, aligned to a cache line. Blocks handed back
+// keep their contents; the link of a free block lives in a header before it.
+// A shared pool may be used from several threads.
+typedef struct
+{
+    size_t size;
+    void *free;
+    long allocated, available;
+    int shared;
+    pthread_mutex_t mutex;
+} pool;
+
+void pool_init(pool *p, size_t size, int shared);
+// Returns a recycled block, or NULL if there is none.
+void *pool_take(pool *p);
+// Returns a new zeroed block.
+void *pool_alloc(pool *p);
+// Returns a recycled block or a new zeroed one.
+void *pool_get(pool *p);
+void pool_put(pool *p, void *block);
+// Frees the blocks in the pool, calling release on each one first if given.
+void pool_destroy(pool *p, void (*release)(void *block));
+
+#endif
@@ -0,0 +1,225 @@
+#define _GNU_SOURCE
+
+#include "reactor.h"
+#include "util.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+void reactor_init(reactor *r)
+{
+    memset(r, 0, sizeof(*r));
+    if ((r->epollfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        ERR("epoll_create1");
+    r->signalfd = -1;
+    sigemptyset(&r->signals);
+    r->running = 1;
+}
+
+void reactor_destroy(reactor *r)
+{
+    if (TEMP_FAILURE_RETRY(close(r->epollfd)))
+        ERR("close");
+    if (r->signalfd >= 0 && TEMP_FAILURE_RETRY(close(r->signalfd)))
+        ERR("close");
+    free(r->heap);
+    r->heap = NULL;
+    r->timers = r->capacity = 0;
+}
+
+void reactor_add(reactor *r, source *s, int fd, uint32_t events,
+                 void (*handle)(reactor *r, source *s, uint32_t events))
+{
+    s->fd = fd;
+    s->events = events;
+    s->handle = handle;
+    struct epoll_event event = {.events = events, .data.ptr = s};
+    if (epoll_ctl(r->epollfd, EPOLL_CTL_ADD, fd, &event))
+        ERR("epoll_ctl");
+}
+
+void reactor_modify(reactor *r, source *s, uint32_t events)
+{
+    if (s->fd < 0 || events == s->events)
+        return;
+    struct epoll_event event = {.events = events, .data.ptr = s};
+    if (epoll_ctl(r->epollfd, EPOLL_CTL_MOD, s->fd, &event))
+        ERR("epoll_ctl");
+    s->events = events;
+}
+
+void reactor_remove(reactor *r, source *s)
+{
+    if (epoll_ctl(r->epollfd, EPOLL_CTL_DEL, s->fd, NULL))
+        ERR("epoll_ctl");
+}
+
+// The timers form a binary min-heap on their deadlines.
+
+static void heap_set(reactor *r, int i, timer *t)
+{
+    r->heap[i] = t;
+    t->index = i;
+}
+
+static void heap_up(reactor *r, int i)
+{
+    timer *t = r->heap[i];
+    for (; i && r->heap[(i - 1) / 2]->when > t->when; i = (i - 1) / 2)
+        heap_set(r, i, r->heap[(i - 1) / 2]);
+    heap_set(r, i, t);
+}
+
+static void heap_down(reactor *r, int i)
+{
+    timer *t = r->heap[i];
+    for (;;)
+    {
+        int child = 2 * i + 1;
+        if (child >= r->timers)
+            break;
+        if (child + 1 < r->timers && r->heap[child + 1]->when < r->heap[child]->when)
+            ++child;
+        if (r->heap[child]->when >= t->when)
+            break;
+        heap_set(r, i, r->heap[child]);
+        i = child;
+    }
+    heap_set(r, i, t);
+}
+
+void timer_init(timer *t, void (*expire)(reactor *r, timer *t))
+{
+    t->when = 0;
+    t->index = -1;
+    t->expire = expire;
+}
+
+void reactor_timer(reactor *r, timer *t, uint64_t when)
+{
+    if (t->index >= 0)
+    {
+        uint64_t before = t->when;
+        t->when = when;
+        if (when < before)
+            heap_up(r, t->index);
+        else
+            heap_down(r, t->index);
+        return;
+    }
+    if (r->timers == r->capacity)
+    {
+        r->capacity = r->capacity ? 2 * r->capacity : 64;
+        if (!(r->heap = realloc(r->heap, r->capacity * sizeof(*r->heap))))
+            ERR("realloc");
+    }
+    t->when = when;
+    heap_set(r, r->timers++, t);
+    heap_up(r, t->index);
+}
+
+void reactor_cancel(reactor *r, timer *t)
+{
+    int i = t->index;
+    if (i < 0)
+        return;
+    t->index = -1;
+    if (i == --r->timers)
+        return;
+    heap_set(r, i, r->heap[r->timers]);
+    if (i && r->heap[(i - 1) / 2]->when > r->heap[i]->when)
+        heap_up(r, i);
+    else
+        heap_down(r, i);
+}
+
+static void handle_signals(reactor *r, source *s, uint32_t events)
+{
+    struct signalfd_siginfo info[16];
+    ssize_t count = TEMP_FAILURE_RETRY(read(s->fd, info, sizeof(info)));
+    if (count < 0)
+    {
+        if (EAGAIN == errno)
+            return;
+        ERR("read");
+    }
+    for (size_t i = 0; i < count / sizeof(*info); ++i)
+        if (r->signal_handlers[info[i].ssi_signo])
+            r->signal_handlers[info[i].ssi_signo](r, info[i].ssi_signo);
+}
+
+void reactor_signal(reactor *r, int sig, void (*handler)(reactor *r, int sig))
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, sig);
+    if (pthread_sigmask(SIG_BLOCK, &mask, NULL))
+        ERR("pthread_sigmask");
+    sigaddset(&r->signals, sig);
+    r->signal_handlers[sig] = handler;
+    int fd = signalfd(r->signalfd, &r->signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0)
+        ERR("signalfd");
+    if (r->signalfd < 0)
+    {
+        r->signalfd = fd;
+        reactor_add(r, &r->signal_source, fd, EPOLLIN, handle_signals);
+    }
+}
+
+// Rounds a deadline up to the milliseconds of epoll_wait.
+static int timeout_until(reactor *r, int timeout)
+{
+    if (!r->timers)
+        return timeout;
+    uint64_t now = now_ns(), when = r->heap[0]->when;
+    if (when <= now)
+        return 0;
+    uint64_t ms = (when - now + 999999) / 1000000;
+    return timeout >= 0 && (uint64_t)timeout < ms ? timeout : (int)(ms < 1u << 30 ? ms : 1u << 30);
+}
+
+int reactor_poll(reactor *r, int timeout)
+{
+    struct epoll_event events[REACTOR_EVENTS];
+    int n = epoll_wait(r->epollfd, events, REACTOR_EVENTS, timeout_until(r, timeout));
+    if (n < 0)
+    {
+        if (errno != EINTR)
+            ERR("epoll_wait");
+        n = 0;
+    }
+    ++r->rounds;
+    r->now = now_ns();
+    for (int i = 0; i < n; ++i)
+    {
+        source *s = events[i].data.ptr;
+        s->handle(r, s, events[i].events);
+    }
+    r->dispatched += n;
+    while (r->timers && r->heap[0]->when <= r->now)
+    {
+        timer *t = r->heap[0];
+        reactor_cancel(r, t);
+        ++r->expired;
+        t->expire(r, t);
+    }
+    if (r->after_batch)
+        r->after_batch(r);
+    return n;
+}
+
+void reactor_run(reactor *r)
+{
+    while (r->running)
+        reactor_poll(r, -1);
+}
+
+void reactor_stop(reactor *r)
+{
+    r->running = 0;
+}
@@ -0,0 +1,79 @@
+#ifndef COMMON_REACTOR_H
+#define COMMON_REACTOR_H
+
+#include <signal.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#define REACTOR_EVENTS 64
+
+typedef struct reactor reactor;
+typedef struct source source;
+typedef struct timer timer;
+
+// A file descriptor watched by a reactor, usually embedded in a bigger
+// structure found again with container_of. A source must stay valid until
+// the end of the batch of events it was closed in.
+struct source
+{
+    int fd;
+    uint32_t events;
+    void (*handle)(reactor *r, source *s, uint32_t events);
+};
+
+// A deadline on CLOCK_MONOTONIC. index is its place in the heap of the
+// reactor, -1 while it is not armed.
+struct timer
+{
+    uint64_t when;
+    int index;
+    void (*expire)(reactor *r, timer *t);
+};
+
+// One thread's event loop: every round waits for the sources or the
+// earliest timer, handles the ready sources, expires the due timers and
+// calls after_batch, which is where output gathered during the batch
+// is best written and closed objects are freed.
+struct reactor
+{
+    int epollfd;
+    int running;
+    timer **heap;
+    int timers, capacity;
+    int signalfd;  // -1 until a signal is watched
+    sigset_t signals;
+    source signal_source;
+    void (*signal_handlers[_NSIG])(reactor *r, int sig);
+    void (*after_batch)(reactor *r);
+    uint64_t now;  // when the current batch started
+    long rounds, dispatched, expired;
+};
+
+void reactor_init(reactor *r);
+// Closes the reactor's own descriptors; the sources are the owners'.
+void reactor_destroy(reactor *r);
+
+void reactor_add(reactor *r, source *s, int fd, uint32_t events,
+                 void (*handle)(reactor *r, source *s, uint32_t events));
+// Does nothing if the events do not change.
+void reactor_modify(reactor *r, source *s, uint32_t events);
+// Needed only if the fd stays open, closing it is enough otherwise.
+void reactor_remove(reactor *r, source *s);
+
+void timer_init(timer *t, void (*expire)(reactor *r, timer *t));
+// Arms the timer, or moves it, to an absolute time in ns.
+void reactor_timer(reactor *r, timer *t, uint64_t when);
+void reactor_cancel(reactor *r, timer *t);
+
+// Blocks the signal in the calling thread and delivers it through a
+// signalfd. Threads started afterwards inherit the blocked signal.
+void reactor_signal(reactor *r, int sig, void (*handler)(reactor *r, int sig));
+
+// One round; waits at most timeout ms if nothing is due (-1 for ever).
+// Returns the number of sources handled.
+int reactor_poll(reactor *r, int timeout);
+// Runs rounds until reactor_stop.
+void reactor_run(reactor *r);
+void reactor_stop(reactor *r);
+
+#endif
@@ -0,0 +1,233 @@
+#define _GNU_SOURCE
+
+#include "buffer.h"
+#include "reactor.h"
+#include "util.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Microbenchmarks of the runtime: dispatching through the reactor, its
+// timer heap, the line reader and the buffer pool.
+
+typedef struct
+{
+    source source;
+    int peer;  // where the byte read goes next
+    long left;
+} endpoint;
+
+long iterations = 200000;
+
+void usage(char *name)
+{
+    fprintf(stderr, "USAGE: %s [-n iterations]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+void report(const char *name, long ops, uint64_t start)
+{
+    double elapsed = (now_ns() - start) / 1e9;
+    printf("%-28s %10ld ops %8.3fs %10.1f ns/op %12.0f ops/s\n", name, ops, elapsed,
+           elapsed * 1e9 / ops, ops / elapsed);
+}
+
+// Passes a byte back over its socket pair until the count is used up.
+void bounce(reactor *r, source *s, uint32_t events)
+{
+    endpoint *e = container_of(s, endpoint, source);
+    char byte;
+    if (TEMP_FAILURE_RETRY(read(s->fd, &byte, 1)) != 1)
+        ERR("read");
+    if (--e->left <= 0)
+    {
+        reactor_stop(r);
+        return;
+    }
+    if (TEMP_FAILURE_RETRY(write(e->peer, &byte, 1)) != 1)
+        ERR("write");
+}
+
+void make_pair(reactor *r, endpoint *a, endpoint *b, long left)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds))
+        ERR("socketpair");
+    a->peer = fds[0];
+    b->peer = fds[1];
+    a->left = b->left = left;
+    reactor_add(r, &a->source, fds[0], EPOLLIN, bounce);
+    reactor_add(r, &b->source, fds[1], EPOLLIN, bounce);
+}
+
+void close_pair(endpoint *a, endpoint *b)
+{
+    if (TEMP_FAILURE_RETRY(close(a->source.fd)) || TEMP_FAILURE_RETRY(close(b->source.fd)))
+        ERR("close");
+}
+
+// One byte bouncing between two sources: the latency of a round.
+void bench_ping_pong(void)
+{
+    reactor r;
+    reactor_init(&r);
+    endpoint a, b;
+    make_pair(&r, &a, &b, iterations);
+    uint64_t start = now_ns();
+    if (TEMP_FAILURE_RETRY(write(a.peer, "x", 1)) != 1)
+        ERR("write");
+    reactor_run(&r);
+    report("ping-pong dispatch", r.dispatched, start);
+    close_pair(&a, &b);
+    reactor_destroy(&r);
+}
+
+// Many pairs busy at once: the cost of a source in a full batch.
+void bench_fan(int pairs)
+{
+    reactor r;
+    reactor_init(&r);
+    endpoint *ends = malloc(2 * pairs * sizeof(*ends));
+    if (!ends)
+        ERR("malloc");
+    for (int i = 0; i < pairs; ++i)
+        make_pair(&r, &ends[2 * i], &ends[2 * i + 1], (iterations + pairs - 1) / pairs + 1);
+    uint64_t start = now_ns();
+    for (int i = 0; i < pairs; ++i)
+        if (TEMP_FAILURE_RETRY(write(ends[2 * i].peer, "x", 1)) != 1)
+            ERR("write");
+    reactor_run(&r);
+    char name[64];
+    snprintf(name, sizeof(name), "fan-out dispatch, %d pairs", pairs);
+    report(name, r.dispatched, start);
+    for (int i = 0; i < pairs; ++i)
+        close_pair(&ends[2 * i], &ends[2 * i + 1]);
+    free(ends);
+    reactor_destroy(&r);
+}
+
+void count_expiry(reactor *r, timer *t)
+{
+}
+
+// Arming, moving and cancelling timers among many, then expiring them.
+void bench_timers(int count)
+{
+    reactor r;
+    reactor_init(&r);
+    timer *timers = malloc(count * sizeof(*timers));
+    if (!timers)
+        ERR("malloc");
+    for (int i = 0; i < count; ++i)
+        timer_init(&timers[i], count_expiry);
+    unsigned seed = 1;
+    uint64_t base = now_ns();
+    uint64_t start = now_ns();
+    long ops = 0;
+    for (long i = 0; i < iterations; ++i, ++ops)
+    {
+        timer *t = &timers[rand_r(&seed) % count];
+        if (t->index >= 0 && rand_r(&seed) % 4 == 0)
+            reactor_cancel(&r, t);
+        else
+            reactor_timer(&r, t, base + rand_r(&seed) % 1000000);
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "timer set/cancel, %d timers", count);
+    report(name, ops, start);
+    start = now_ns();
+    long armed = r.timers;
+    while (r.timers)
+        reactor_poll(&r, 0);
+    report("timer expiry", armed, start);
+    free(timers);
+    reactor_destroy(&r);
+}
+
+// Splitting pipelined input into lines.
+void bench_reader(void)
+{
+    reader rd;
+    reader_init(&rd, 100);
+    const char *chunk = "1\n-2\n0\n2\n-1\n";
+    long lines = 0;
+    uint64_t start = now_ns();
+    for (long i = 0; i < iterations; ++i)
+    {
+        buffer_append(&rd.in, chunk, strlen(chunk));
+        while (reader_line(&rd))
+            ++lines;
+    }
+    report("reader lines", lines, start);
+    reader_free(&rd);
+}
+
+void bench_pool(int shared)
+{
+    pool p;
+    pool_init(&p, 1024, shared);
+    void *blocks[16];
+    uint64_t start = now_ns();
+    for (long i = 0; i < iterations; ++i)
+    {
+        for (int j = 0; j < 16; ++j)
+            blocks[j] = pool_get(&p);
+        for (int j = 0; j < 16; ++j)
+            pool_put(&p, blocks[j]);
+    }
+    report(shared ? "pool get/put, shared" : "pool get/put", 32 * iterations, start);
+    pool_destroy(&p, NULL);
+}
+
+void bench_malloc(void)
+{
+    void *blocks[16];
+    uint64_t start = now_ns();
+    for (long i = 0; i < iterations; ++i)
+    {
+        for (int j = 0; j < 16; ++j)
+            if (!(blocks[j] = malloc(1024)))
+                ERR("malloc");
+        for (int j = 0; j < 16; ++j)
+            free(blocks[j]);
+    }
+    report("malloc/free, for comparison", 32 * iterations, start);
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    while ((c = getopt(argc, argv, "n:")) != -1)
+        switch (c)
+        {
+        case 'n':
+            iterations = strtol(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    if (optind != argc || iterations < 1)
+        usage(argv[0]);
+    // the big fan needs more descriptors than the usual soft limit
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit))
+        ERR("getrlimit");
+    limit.rlim_cur = limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit))
+        ERR("setrlimit");
+    bench_ping_pong();
+    bench_fan(16);
+    bench_fan(1024);
+    bench_timers(64);
+    bench_timers(65536);
+    bench_reader();
+    bench_pool(0);
+    bench_pool(1);
+    bench_malloc();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,201 @@
+#define _GNU_SOURCE
+
+#include "trace.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+typedef struct
+{
+    uint64_t time;
+    const char *name;
+    char phase;
+} trace_record;
+
+// Written by its own thread only, so recording takes no lock; a dump reads
+// the records below head, and may see the oldest being overwritten.
+typedef struct trace_ring
+{
+    _Atomic uint64_t head;
+    pid_t tid;
+    struct trace_ring *next;
+    trace_record records[TRACE_EVENTS];
+} trace_ring;
+
+static _Atomic(trace_ring *) rings;
+static __thread trace_ring *local;
+static char prefix[256];
+
+static trace_ring *trace_register(void)
+{
+    trace_ring *ring = calloc(1, sizeof(*ring));
+    if (!ring)
+        ERR("calloc");
+    ring->tid = syscall(SYS_gettid);
+    ring->next = atomic_load(&rings);
+    while (!atomic_compare_exchange_weak(&rings, &ring->next, ring))
+        ;
+    return local = ring;
+}
+
+void trace_event(const char *name, char phase)
+{
+    trace_ring *ring = local ? local : trace_register();
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    trace_record *record = &ring->records[head & (TRACE_EVENTS - 1)];
+    record->time = now_ns();
+    record->name = name;
+    record->phase = phase;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Output of the dump, formatted by hand since stdio is not signal-safe.
+typedef struct
+{
+    int fd;
+    int failed;
+    size_t len;
+    char buf[4096];
+} trace_out;
+
+static void out_flush(trace_out *out)
+{
+    char *p = out->buf;
+    while (out->len && !out->failed)
+    {
+        ssize_t count = TEMP_FAILURE_RETRY(write(out->fd, p, out->len));
+        if (count < 0)
+            out->failed = 1;
+        else
+        {
+            p += count;
+            out->len -= count;
+        }
+    }
+    out->len = 0;
+}
+
+static void out_str(trace_out *out, const char *s)
+{
+    for (; *s; ++s)
+    {
+        if (out->len == sizeof(out->buf))
+            out_flush(out);
+        out->buf[out->len++] = *s;
+    }
+}
+
+// Writes value in decimal, zero padded to digits; returns the length.
+static int format_num(char *dst, uint64_t value, int digits)
+{
+    char num[20];
+    int len = 0;
+    do
+    {
+        num[len++] = '0' + value % 10;
+        value /= 10;
+    } while (value || len < digits);
+    for (int i = 0; i < len; ++i)
+        dst[i] = num[len - 1 - i];
+    dst[len] = 0;
+    return len;
+}
+
+static void out_num(trace_out *out, uint64_t value, int digits)
+{
+    char num[24];
+    format_num(num, value, digits);
+    out_str(out, num);
+}
+
+static void out_event(trace_out *out, const trace_record *record, pid_t pid, pid_t tid)
+{
+    char phase[] = {record->phase, 0};
+    out_str(out, "{\"name\":\"");
+    out_str(out, record->name);
+    out_str(out, "\",\"ph\":\"");
+    out_str(out, phase);
+    // microseconds, the unit of the format
+    out_str(out, "\",\"ts\":");
+    out_num(out, record->time / 1000, 1);
+    out_str(out, ".");
+    out_num(out, record->time % 1000, 3);
+    out_str(out, ",\"pid\":");
+    out_num(out, pid, 1);
+    out_str(out, ",\"tid\":");
+    out_num(out, tid, 1);
+    if ('i' == record->phase)
+        out_str(out, ",\"s\":\"t\"");
+    out_str(out, "},\n");
+}
+
+void trace_dump(void)
+{
+    trace_out out = {.len = 0, .failed = 0};
+    char path[sizeof(prefix) + 32];
+    pid_t pid = getpid();
+    size_t len = strlen(prefix);
+    memcpy(path, prefix, len);
+    path[len++] = '-';
+    len += format_num(path + len, pid, 1);
+    memcpy(path + len, ".json", sizeof(".json"));
+    if ((out.fd = TEMP_FAILURE_RETRY(open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644))) < 0)
+        return;
+    out_str(&out, "{\"traceEvents\":[\n");
+    for (trace_ring *ring = atomic_load(&rings); ring; ring = ring->next)
+    {
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for (uint64_t i = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0; i < head; ++i)
+            out_event(&out, &ring->records[i & (TRACE_EVENTS - 1)], pid, ring->tid);
+    }
+    // tracemerge relies on the events being one per line, before this one
+    out_str(&out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":");
+    out_num(&out, pid, 1);
+    out_str(&out, ",\"args\":{\"name\":\"");
+    out_str(&out, program_invocation_short_name);
+    out_str(&out, "\"}}\n]}\n");
+    out_flush(&out);
+    TEMP_FAILURE_RETRY(close(out.fd));
+}
+
+static void trace_signal(int sig)
+{
+    int saved = errno;
+    trace_dump();
+    errno = saved;
+}
+
+// The child starts with empty rings; the parent dumps its own events.
+static void trace_forked(void)
+{
+    for (trace_ring *ring = atomic_load(&rings); ring; ring = ring->next)
+        atomic_store(&ring->head, 0);
+    if (local)
+        local->tid = syscall(SYS_gettid);
+}
+
+// Runs in every program that records an event, since that links trace.o.
+__attribute__((constructor)) static void trace_init(void)
+{
+    const char *name = getenv("TRACE_FILE");
+    snprintf(prefix, sizeof(prefix), "%s", name && *name ? name : "trace");
+    if (pthread_atfork(NULL, NULL, trace_forked))
+        ERR("pthread_atfork");
+    if (atexit(trace_dump))
+        ERR("atexit");
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = trace_signal;
+    act.sa_flags = SA_RESTART;
+    if (sigaction(SIGUSR2, &act, NULL))
+        ERR("sigaction");
+}
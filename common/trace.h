@@ -0,0 +1,32 @@
+#ifndef COMMON_TRACE_H
+#define COMMON_TRACE_H
+
+#include <stdint.h>
+
+// Begin/end events of the hot paths, kept in a ring per thread and written
+// as Chrome trace JSON (chrome://tracing, ui.perfetto.dev) when the process
+// exits or gets SIGUSR2. Each process writes $TRACE_FILE-<pid>.json,
+// trace-<pid>.json by default; tracemerge joins the files of a run.
+//
+// Tracing is compiled in with -DTRACE (make TRACE=1). Without it the macros
+// expand to nothing and trace.o is not even linked.
+
+#define TRACE_EVENTS (1 << 16)  // per thread, the oldest are overwritten
+
+void trace_event(const char *name, char phase);
+
+#ifdef TRACE
+// name must be a string literal: only its address is recorded
+#define TRACE_BEGIN(name) trace_event(name, 'B')
+#define TRACE_END(name) trace_event(name, 'E')
+#define TRACE_MARK(name) trace_event(name, 'i')
+#else
+#define TRACE_BEGIN(name) ((void)0)
+#define TRACE_END(name) ((void)0)
+#define TRACE_MARK(name) ((void)0)
+#endif
+
+// Writes what the rings hold now; only async-signal-safe calls are used.
+void trace_dump(void);
+
+#endif
@@ -0,0 +1,82 @@
+#define _GNU_SOURCE
+
+#include "trace.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// The cost of a trace event on the hot path, alone and with every thread
+// recording at once, and of dumping the rings. The trace of the run is
+// written to $TRACE_FILE-<pid>.json like in any traced program.
+
+long iterations = 10000000;
+
+void usage(char *name)
+{
+    fprintf(stderr, "USAGE: %s [-n iterations] [-t threads]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+void report(const char *name, long ops, uint64_t start)
+{
+    double elapsed = (now_ns() - start) / 1e9;
+    printf("%-28s %10ld ops %8.3fs %10.1f ns/op %12.0f ops/s\n", name, ops, elapsed,
+           elapsed * 1e9 / ops, ops / elapsed);
+}
+
+void *record(void *arg)
+{
+    for (long i = 0; i < iterations; i += 2)
+    {
+        trace_event("bench", 'B');
+        trace_event("bench", 'E');
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = 4;
+    int c;
+    while ((c = getopt(argc, argv, "n:t:")) != -1)
+        switch (c)
+        {
+        case 'n':
+            iterations = strtol(optarg, NULL, 10);
+            break;
+        case 't':
+            threads = strtol(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    if (optind != argc || iterations < 2 || threads < 1)
+        usage(argv[0]);
+
+    uint64_t start = now_ns();
+    record(NULL);
+    report("trace event", iterations, start);
+
+    pthread_t *ids = malloc(threads * sizeof(*ids));
+    if (!ids)
+        ERR("malloc");
+    start = now_ns();
+    for (int i = 0; i < threads; ++i)
+        if (pthread_create(&ids[i], NULL, record, NULL))
+            ERR("pthread_create");
+    for (int i = 0; i < threads; ++i)
+        if (pthread_join(ids[i], NULL))
+            ERR("pthread_join");
+    char name[64];
+    snprintf(name, sizeof(name), "trace event, %d threads", threads);
+    report(name, threads * iterations, start);
+    free(ids);
+
+    start = now_ns();
+    trace_dump();
+    report("trace dump, events", (threads + 1L) * (iterations < TRACE_EVENTS ? iterations : TRACE_EVENTS), start);
+    return EXIT_SUCCESS;
+}
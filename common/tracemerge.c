@@ -0,0 +1,51 @@
+#define _GNU_SOURCE
+
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Joins the trace files the processes of a run wrote into one Chrome trace,
+// so that forked children and separate programs show up on one timeline.
+// Every event of a trace file is a line of its own.
+
+void usage(char *name)
+{
+    fprintf(stderr, "USAGE: %s trace.json... > merged.json\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+        usage(argv[0]);
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    int first = 1;
+    printf("{\"traceEvents\":[\n");
+    for (int i = 1; i < argc; ++i)
+    {
+        FILE *file = fopen(argv[i], "r");
+        if (!file)
+            ERR(argv[i]);
+        while ((len = getline(&line, &size, file)) > 0)
+        {
+            if (strncmp(line, "{\"name\":", strlen("{\"name\":")))
+                continue;
+            while (len > 0 && ('\n' == line[len - 1] || ',' == line[len - 1]))
+                line[--len] = 0;
+            printf("%s%s", first ? "" : ",\n", line);
+            first = 0;
+        }
+        if (ferror(file))
+            ERR("getline");
+        if (fclose(file))
+            ERR("fclose");
+    }
+    printf("\n]}\n");
+    free(line);
+    return EXIT_SUCCESS;
+}
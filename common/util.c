@@ -0,0 +1,148 @@
+#define _GNU_SOURCE
+
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+int err_kill_group = 0;
+
+void die(const char *source, const char *file, int line)
+{
+    perror(source);
+    fprintf(stderr, "%s:%d\n", file, line);
+    if (err_kill_group)
+        kill(0, SIGKILL);
+    exit(EXIT_FAILURE);
+}
+
+void set_handler(void (*f)(int), int sig)
+{
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = f;
+    if (sigaction(sig, &act, NULL))
+        ERR("sigaction");
+}
+
+int make_socket(int domain, int type)
+{
+    int socketfd = socket(domain, type, 0);
+    if (socketfd < 0)
+        ERR("socket");
+    return socketfd;
+}
+
+static int bind_inet(uint16_t port, int type, int backlog, int reuseport)
+{
+    int socketfd = make_socket(PF_INET, type);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int t = 1;
+    if (setsockopt(socketfd, SOL_SOCKET, SO_REUSEADDR, &t, sizeof(t)))
+        ERR("setsockopt");
+    if (reuseport && setsockopt(socketfd, SOL_SOCKET, SO_REUSEPORT, &t, sizeof(t)))
+        ERR("setsockopt");
+    if (bind(socketfd, (struct sockaddr *)&addr, sizeof(addr)))
+        ERR("bind");
+    if ((type & SOCK_STREAM) && listen(socketfd, backlog))
+        ERR("listen");
+    return socketfd;
+}
+
+int bind_inet_socket(uint16_t port, int type, int backlog)
+{
+    return bind_inet(port, type, backlog, 0);
+}
+
+int bind_shared_inet_socket(uint16_t port, int type, int backlog)
+{
+    return bind_inet(port, type, backlog, 1);
+}
+
+int add_new_client(int socketfd)
+{
+    int fd = TEMP_FAILURE_RETRY(accept(socketfd, NULL, NULL));
+    if (fd < 0)
+    {
+        if (EAGAIN == errno || EWOULDBLOCK == errno)
+            return -1;
+        ERR("accept");
+    }
+    return fd;
+}
+
+struct sockaddr_in make_address(const char *address, const char *port)
+{
+    struct addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    struct addrinfo *result;
+    int ret = getaddrinfo(address, port, &hints, &result);
+    if (ret)
+    {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
+        exit(EXIT_FAILURE);
+    }
+    struct sockaddr_in addr = *(struct sockaddr_in *)(result->ai_addr);
+    freeaddrinfo(result);
+    return addr;
+}
+
+void set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK))
+        ERR("fcntl");
+}
+
+ssize_t bulk_read(int fd, char *buf, size_t count)
+{
+    ssize_t c;
+    size_t len = 0;
+    do
+    {
+        c = TEMP_FAILURE_RETRY(read(fd, buf, count));
+        if (c < 0)
+            return c;
+        if (0 == c)
+            return len;
+        buf += c;
+        len += c;
+        count -= c;
+    } while (count > 0);
+    return len;
+}
+
+ssize_t bulk_write(int fd, const char *buf, size_t count)
+{
+    ssize_t c;
+    size_t len = 0;
+    do
+    {
+        c = TEMP_FAILURE_RETRY(write(fd, buf, count));
+        if (c < 0)
+            return c;
+        buf += c;
+        len += c;
+        count -= c;
+    } while (count > 0);
+    return len;
+}
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts))
+        ERR("clock_gettime");
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,43 @@
+#ifndef COMMON_UTIL_H
+#define COMMON_UTIL_H
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Helpers every program of the repository used to carry a copy of.
+
+#define ERR(source) die(source, __FILE__, __LINE__)
+
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+// Set by programs that fork, so that an error takes the children down too.
+extern int err_kill_group;
+
+void die(const char *source, const char *file, int line) __attribute__((noreturn));
+
+void set_handler(void (*f)(int), int sig);
+
+int make_socket(int domain, int type);
+
+// Binds a loopback socket; a stream socket is also put into listening state.
+int bind_inet_socket(uint16_t port, int type, int backlog);
+// The same with SO_REUSEPORT, for processes that each accept on the port.
+int bind_shared_inet_socket(uint16_t port, int type, int backlog);
+
+// Returns -1 if there is no connection to accept on a non-blocking socket.
+int add_new_client(int socketfd);
+
+struct sockaddr_in make_address(const char *address, const char *port);
+
+void set_nonblocking(int fd);
+
+// Return the number of bytes transferred before EOF, or -1 on error.
+ssize_t bulk_read(int fd, char *buf, size_t count);
+ssize_t bulk_write(int fd, const char *buf, size_t count);
+
+// CLOCK_MONOTONIC in nanoseconds
+uint64_t now_ns(void);
+
+#endif
@@ -1,72 +1,523 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <poll.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
-#define ERR(source) (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
-                     perror(source), kill(0, SIGKILL),               \
-                     exit(EXIT_FAILURE))
+#include "reactor.h"
+#include "trace.h"
+#include "util.h"
+
+#define CHILDREN 2
+#define MAX_CHILDREN 64
+#define GENERATIONS 3
+#define HISTOGRAM 64
+#define INJECTED "injected"
+#define INJECTED_LEN (sizeof(INJECTED) - 1)
+#define MAX_PAYLOAD ((int)(PIPE_BUF - sizeof(struct frame) - INJECTED_LEN))
+#define MAX_LARGE_PAYLOAD (256 * 1024)  // when every child has a pipe of its own
+#define FRAME_INJECTED 1
+
+#define BACKLOG 16
+#define GAUGE_BINS 10
+
+#define SINK_BUF (1 << 20)
+#define SINK_IOV (IOV_MAX & ~1)
+#define SINK_HDR 32
+
+#define INLET_FRAMES 4  // frames of the largest size an inlet buffer holds
+#define MERGE_WINDOW_MS 10
+
+// Header preceding every payload on the pipes. Each generation stamps
+// its own slot of stamp[] with CLOCK_MONOTONIC when it handles the frame.
+struct frame
+{
+    int size;  // payload length
+    uint16_t producer;
+    uint16_t flags;
+    uint32_t seq;
+    uint64_t stamp[GENERATIONS];
+};
+
+enum sink_mode
+{
+    SINK_TEXT,
+    SINK_BINARY,
+    SINK_COUNT
+};
+
+enum policy
+{
+    POLICY_BLOCK,
+    POLICY_DROP_NEWEST,
+    POLICY_DROP_OLDEST
+};
+
+// How the root reads the forwarders: all of them from one pipe, where a
+// frame has to fit in PIPE_BUF to stay whole, or from a pipe per forwarder,
+// merged in the order the frames arrive, in turns, or by production time.
+enum merge
+{
+    MERGE_SHARED,
+    MERGE_ARRIVAL,
+    MERGE_ROUND_ROBIN,
+    MERGE_TIMESTAMP
+};
+
+enum arrival
+{
+    ARRIVAL_CONST,
+    ARRIVAL_BURST,
+    ARRIVAL_POISSON
+};
+
+struct options
+{
+    int t, n, r, b;
+    double fps;  // target frames/s per producer, 0 = unlimited
+    double bps;  // target bytes/s per producer, 0 = not limited by size
+    enum arrival arrival;
+    int burst;   // frames sent back to back in ARRIVAL_BURST
+    char *output;
+    enum sink_mode sink;
+    int producer_pipe;  // F_SETPIPE_SZ of producer -> forwarder pipes, 0 = default
+    int root_pipe;      // F_SETPIPE_SZ of the forwarders -> root pipe, 0 = default
+    enum policy policy;
+    int gauge_ms;       // FIONREAD sampling period of the readers
+    int children;
+    enum merge merge;
+    int window_ms;      // how long MERGE_TIMESTAMP waits for a late forwarder
+    int max_payload;
+};
+
+// Non-blocking writing end of a pipe. When the pipe is full the frame is
+// waited for, dropped, or parked in a small backlog whose oldest entry
+// gives way to newer frames, depending on the policy.
+struct channel
+{
+    int fd;
+    enum policy policy;
+    char *slot;  // BACKLOG frames of up to frame_size bytes
+    int frame_size;
+    int len[BACKLOG];
+    int head, count;
+    long written, dropped, stalls;
+    uint64_t stalled_ns;
+};
+
+// Fill level of a pipe as seen by its reader, sampled at most every period.
+struct gauge
+{
+    int capacity;
+    uint64_t period, next;
+    long samples, sum, max;
+    long bins[GAUGE_BINS + 1];
+};
+
+// Absolute-deadline pacing: every frame has a scheduled emission time
+// derived from the previous one, so time spent in write() never drifts the rate.
+struct pacer
+{
+    const struct options *opts;
+    struct timespec next;
+    long sent;
+};
+
+// Batched output stage of the first generation. Frames are read from the
+// pipe in bulk and handed over as iovecs pointing into the read buffer,
+// so every read() is followed by a single writev() of everything it brought.
+struct sink
+{
+    int fd;
+    enum sink_mode mode;
+    struct iovec iov[SINK_IOV];
+    int iovcnt;
+    char hdr[SINK_IOV / 2][SINK_HDR];
+    int open;  // last text record still needs its closing bracket
+    int max_payload;
+    long frames, bytes, invalid;
+};
+
+struct producer_stats
+{
+    long frames, bytes, injected, lost, reordered;
+    uint32_t next_seq;
+    uint64_t first, last;
+};
+
+// Per-hop latency: hop 0 is producer -> forwarder, hop 1 forwarder -> root,
+// hop 2 end to end. Buckets are powers of two in nanoseconds.
+struct latency
+{
+    long histogram[HISTOGRAM];
+    uint64_t min, max, sum;
+    long count;
+};
+
+// Pipe of one forwarder to the root, with what has been read from it but
+// not merged yet. An inlet whose buffer is full is not read until the
+// merge takes frames out of it.
+struct inlet
+{
+    source source;  // fd -1 after EOF, no events while the buffer is full
+    char *buf;
+    size_t size, pos, fill;
+    int frame;  // the largest frame, with its header
+};
+
+struct stats
+{
+    int children;
+    struct producer_stats producer[MAX_CHILDREN];
+    struct latency hop[GENERATIONS];
+    struct gauge gauge[MAX_CHILDREN];  // of the root pipe, or of every inlet
+    long invalid;
+};
 
 volatile sig_atomic_t last_signal = 0;
+volatile sig_atomic_t report_requested = 0;
 
 void usage(char *name)
 {
-    fprintf(stderr, "USAGE: %s t n r b\n", name);
-    fprintf(stderr, "t in [50,500]\n");
-    fprintf(stderr, "n in [3,30]\n");
+    fprintf(stderr, "USAGE: %s [-f fps] [-y bps] [-a const|burst:k|poisson] [-o file] [-O text|binary|count]\n"
+                    "       [-p bytes] [-P bytes] [-d block|drop-newest|drop-oldest] [-g ms] [-c children]\n"
+                    "       [-m shared|arrival|round-robin|timestamp[:ms]] [-s bytes] t n r b\n",
+            name);
+    fprintf(stderr, "t in [0,500] (ms between frames, 0 = unlimited)\n");
+    fprintf(stderr, "n >= 3\n");
     fprintf(stderr, "r in [0,100]\n");
-    fprintf(stderr, "b in [1,PIPE_BUF-6]\n");
+    fprintf(stderr, "b in [1,s]\n");
+    fprintf(stderr, "-f target frames/s per producer, overrides t (0 = unlimited)\n");
+    fprintf(stderr, "-y target bytes/s per producer, overrides t; with -f too, the slower of the two rates holds\n");
+    fprintf(stderr, "-a arrival pattern, default const\n");
+    fprintf(stderr, "-o output file, default stdout\n");
+    fprintf(stderr, "-O output format, default text\n");
+    fprintf(stderr, "-p capacity of the producer pipes, -P of the root pipe\n");
+    fprintf(stderr, "-d policy of the writers when a pipe is full, default block\n");
+    fprintf(stderr, "-g pipe fill sampling period, default 10\n");
+    fprintf(stderr, "-c number of forwarders, each with its producer, in [1,%d], default %d\n", MAX_CHILDREN, CHILDREN);
+    fprintf(stderr, "-m one pipe shared by the forwarders, default, or a pipe per forwarder merged in order of\n"
+                    "   arrival, in turns, or by production time, waiting up to ms (default %d) for a late one\n",
+            MERGE_WINDOW_MS);
+    fprintf(stderr, "-s largest payload, at most %d with a shared pipe and %d otherwise, default %d\n", MAX_PAYLOAD,
+            MAX_LARGE_PAYLOAD, MAX_PAYLOAD);
+    fprintf(stderr, "statistics are printed to stderr at EOF and on SIGUSR1\n");
     exit(EXIT_FAILURE);
 }
 
-void set_handler(void (*f)(int), int sig)
+void sig_handler(int sig)
 {
-    struct sigaction act;
-    memset(&act, 0, sizeof(act));
-    act.sa_handler = f;
-    if (sigaction(sig, &act, NULL) < 0)
-        ERR("sigaction()");
+    last_signal = sig;
 }
 
-void sig_handler(int sig)
+void report_handler(int sig)
 {
-    last_signal = sig;
+    report_requested = 1;
+}
+
+void timespec_add_ns(struct timespec *ts, double ns)
+{
+    long long total = ts->tv_nsec + (long long)ns;
+    ts->tv_sec += total / 1000000000;
+    ts->tv_nsec = total % 1000000000;
+}
+
+void pacer_init(struct pacer *p, const struct options *opts)
+{
+    p->opts = opts;
+    p->sent = 0;
+    if (clock_gettime(CLOCK_MONOTONIC, &p->next))
+        ERR("clock_gettime()");
+}
+
+// Sleeps until the scheduled emission time of the next frame.
+// In burst mode only the first frame of every burst waits.
+void pacer_wait(struct pacer *p)
+{
+    const struct options *opts = p->opts;
+    if (!opts->fps && !opts->bps)
+        return;
+    if (ARRIVAL_BURST == opts->arrival && p->sent % opts->burst)
+        return;
+    int ret;
+    while ((ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &p->next, NULL)))
+    {
+        if (ret != EINTR)
+        {
+            errno = ret;
+            ERR("clock_nanosleep()");
+        }
+        if (last_signal == SIGINT)
+            return;
+    }
+}
+
+// Advances the schedule by the gap owed for a frame of the given size:
+// the longer of the frame rate's and the byte rate's, so each is a cap.
+void pacer_advance(struct pacer *p, size_t bytes)
+{
+    const struct options *opts = p->opts;
+    ++p->sent;
+    double gap = 0;
+    if (opts->fps)
+        gap = 1e9 / opts->fps;
+    if (opts->bps && 1e9 * bytes / opts->bps > gap)
+        gap = 1e9 * bytes / opts->bps;
+    if (ARRIVAL_POISSON == opts->arrival)
+        gap *= -log((rand() + 1.0) / (RAND_MAX + 2.0));
+    timespec_add_ns(&p->next, gap);
+}
+
+// Creates a pipe and applies the requested capacity to it.
+void make_pipe(int pipedes[2], int capacity)
+{
+    if (pipe(pipedes))
+        ERR("pipe()");
+    if (capacity && fcntl(pipedes[1], F_SETPIPE_SZ, capacity) < 0)
+        ERR("fcntl()");
+}
+
+// Clamps a requested capacity to /proc/sys/fs/pipe-max-size.
+int pipe_capacity(int requested)
+{
+    FILE *f = fopen("/proc/sys/fs/pipe-max-size", "r");
+    int max;
+    if (!f)
+        return requested;
+    if (fscanf(f, "%d", &max) != 1)
+        max = requested;
+    fclose(f);
+    if (requested > max)
+    {
+        fprintf(stderr, "pipe capacity %d clamped to %d\n", requested, max);
+        return max;
+    }
+    return requested;
+}
+
+// Largest frame on the pipes, header and injected text included.
+int frame_size(const struct options *opts)
+{
+    return sizeof(struct frame) + opts->max_payload + INJECTED_LEN;
+}
+
+// A header read from the root pipes, whose payload may carry the injection.
+void check_header(const struct frame *hdr, int frame)
+{
+    if (hdr->size < 0 || hdr->size > frame - (int)sizeof(*hdr))
+    {
+        errno = EBADMSG;
+        ERR("read()");
+    }
 }
 
-void third_generation(int wrend, int t, int n, int b)
+void channel_init(struct channel *ch, int fd, const struct options *opts)
+{
+    memset(ch, 0, sizeof(*ch));
+    ch->fd = fd;
+    ch->policy = opts->policy;
+    ch->frame_size = frame_size(opts);
+    set_nonblocking(fd);
+    if (POLICY_DROP_OLDEST == ch->policy && !(ch->slot = malloc(BACKLOG * ch->frame_size)))
+        ERR("malloc()");
+}
+
+void channel_wait(struct channel *ch)
+{
+    struct pollfd pfd = {ch->fd, POLLOUT, 0};
+    uint64_t start = now_ns();
+    TRACE_BEGIN("pipe full");
+    while (poll(&pfd, 1, -1) < 0)
+        if (errno != EINTR)
+            ERR("poll()");
+    TRACE_END("pipe full");
+    ++ch->stalls;
+    ch->stalled_ns += now_ns() - start;
+}
+
+// Returns 1 if the frame went into the pipe and 0 if the pipe is full.
+// Only a frame larger than PIPE_BUF, on a pipe with a single writer, can be
+// taken in part; its rest is waited for, as nothing may come in between.
+int channel_try(struct channel *ch, const char *buf, int len)
+{
+    int written = 1;
+    ssize_t count;
+    TRACE_BEGIN("pipe write");
+    while ((count = write(ch->fd, buf, len)) < 0)
+    {
+        if (EAGAIN == errno)
+        {
+            written = 0;
+            break;
+        }
+        if (errno != EINTR)
+            ERR("write()");
+    }
+    TRACE_END("pipe write");
+    for (buf += count, len -= count; written && len > 0; buf += count, len -= count)
+    {
+        channel_wait(ch);
+        if ((count = write(ch->fd, buf, len)) < 0)
+        {
+            if (EAGAIN == errno || EINTR == errno)
+                count = 0;
+            else
+                ERR("write()");
+        }
+    }
+    ch->written += written;
+    return written;
+}
+
+// Moves as much of the backlog into the pipe as fits without blocking.
+void channel_flush(struct channel *ch)
+{
+    for (; ch->count && channel_try(ch, ch->slot + ch->head * ch->frame_size, ch->len[ch->head]); --ch->count)
+        ch->head = (ch->head + 1) % BACKLOG;
+}
+
+void channel_write(struct channel *ch, const char *buf, int len)
+{
+    switch (ch->policy)
+    {
+    case POLICY_BLOCK:
+        while (!channel_try(ch, buf, len))
+            channel_wait(ch);
+        return;
+    case POLICY_DROP_NEWEST:
+        if (!channel_try(ch, buf, len))
+            ++ch->dropped;
+        return;
+    case POLICY_DROP_OLDEST:
+        channel_flush(ch);
+        if (!ch->count && channel_try(ch, buf, len))
+            return;
+        if (BACKLOG == ch->count)
+        {
+            ch->head = (ch->head + 1) % BACKLOG;
+            --ch->count;
+            ++ch->dropped;
+        }
+        int tail = (ch->head + ch->count++) % BACKLOG;
+        memcpy(ch->slot + tail * ch->frame_size, buf, len);
+        ch->len[tail] = len;
+        return;
+    }
+}
+
+// Drains the backlog, reports drops and stalls, and closes the pipe.
+void channel_close(struct channel *ch, const char *role, int producer)
+{
+    for (channel_flush(ch); ch->count; channel_flush(ch))
+        channel_wait(ch);
+    if (ch->dropped || ch->stalls)
+        fprintf(stderr, "%s %d: written %ld dropped %ld stalls %ld (%.1f ms blocked)\n",
+                role, producer, ch->written, ch->dropped, ch->stalls, ch->stalled_ns / 1e6);
+    free(ch->slot);
+    if (close(ch->fd))
+        ERR("close()");
+}
+
+void gauge_init(struct gauge *g, int fd, int period_ms)
+{
+    memset(g, 0, sizeof(*g));
+    if ((g->capacity = fcntl(fd, F_GETPIPE_SZ)) < 0)
+        ERR("fcntl()");
+    g->period = period_ms * 1000000ULL;
+}
+
+void gauge_sample(struct gauge *g, int fd, uint64_t now)
+{
+    if (now < g->next)
+        return;
+    g->next = now + g->period;
+    int level;
+    if (ioctl(fd, FIONREAD, &level))
+        ERR("ioctl()");
+    ++g->samples;
+    g->sum += level;
+    if (level > g->max)
+        g->max = level;
+    ++g->bins[(long)level * GAUGE_BINS / g->capacity];
+}
+
+// Samples the level a blocking reader finds once the pipe is readable,
+// before its read drains it.
+void gauge_poll(struct gauge *g, int fd)
+{
+    if (now_ns() < g->next)
+        return;
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, -1) < 0)
+    {
+        if (EINTR == errno)
+            return;
+        ERR("poll()");
+    }
+    gauge_sample(g, fd, now_ns());
+}
+
+void gauge_report(struct gauge *g, const char *role, int producer)
+{
+    if (!g->samples)
+        return;
+    fprintf(stderr, "%s %d pipe fill: capacity %d samples %ld avg %ld max %ld |", role, producer,
+            g->capacity, g->samples, g->sum / g->samples, g->max);
+    for (int i = 0; i <= GAUGE_BINS; ++i)
+        fprintf(stderr, " %ld", g->bins[i]);
+    fprintf(stderr, " |\n");
+}
+
+void third_generation(int wrend, int producer, const struct options *opts)
 {
     set_handler(sig_handler, SIGINT);
     srand(getpid());
-    struct timespec st = {0, t * 1000000};
-    int size;
-    size_t offset = sizeof(size);
-    char buf[PIPE_BUF];
-    for (int i = 0; i < n; ++i)
+    struct pacer pacer;
+    pacer_init(&pacer, opts);
+    int b = opts->b;
+    struct channel ch;
+    channel_init(&ch, wrend, opts);
+    struct frame hdr = {.producer = producer};
+    size_t offset = sizeof(hdr);
+    char *buf = malloc(frame_size(opts));
+    if (!buf)
+        ERR("malloc()");
+    for (int i = 0; i < opts->n; ++i)
     {
+        pacer_wait(&pacer);
         if (last_signal == SIGINT)
             // interruption with C-c
             break;
-        size = b + rand() % (PIPE_BUF - b - 5);
-        for (int j = 0; j < size; ++j)
+        hdr.size = b + rand() % (opts->max_payload - b + 1);
+        hdr.seq = i;
+        for (int j = 0; j < hdr.size; ++j)
             buf[j + offset] = 'a' + rand() % ('z' - 'a' + 1);
-        memcpy(buf, &size, offset);
-        if (write(wrend, buf, size + offset) < 0)
-            ERR("write()");
-        nanosleep(&st, NULL);
+        hdr.stamp[0] = now_ns();
+        memcpy(buf, &hdr, offset);
+        channel_write(&ch, buf, hdr.size + offset);
+        pacer_advance(&pacer, hdr.size + offset);
     }
-    if (close(wrend))
-        ERR("close()");
+    channel_close(&ch, "producer", producer);
+    free(buf);
 }
 
-void second_generation(int wrend, int t, int n, int r, int b)
+void second_generation(int wrend, int producer, const struct options *opts)
 {
     srand(getpid());
     int pipedes[2];
-    if (pipe(pipedes))
-        ERR("pipe()");
+    make_pipe(pipedes, opts->producer_pipe);
     switch (fork())
     {
     case -1:
@@ -74,88 +525,667 @@ void second_generation(int wrend, int t, int n, int r, int b)
     case 0:
         if (close(pipedes[0]))
             ERR("close()");
-        third_generation(pipedes[1], t, n, b);
+        third_generation(pipedes[1], producer, opts);
         exit(EXIT_SUCCESS);
     }
     if (close(pipedes[1]))
         ERR("close()");
+    struct channel ch;
+    channel_init(&ch, wrend, opts);
+    struct gauge gauge;
+    gauge_init(&gauge, pipedes[0], opts->gauge_ms);
     ssize_t status;
-    int size;
-    size_t offset = sizeof(size);
-    char buf[PIPE_BUF];
-    const char *message = "injected";
-    const size_t length = sizeof(message);
+    struct frame hdr;
+    size_t offset = sizeof(hdr);
+    char *buf = malloc(frame_size(opts));
+    if (!buf)
+        ERR("malloc()");
     do
     {
-        if ((status = read(pipedes[0], &size, offset)) < 0)
+        while (ch.count)
+        {
+            // keep the backlog moving while waiting for the next frame
+            struct pollfd pfd[2] = {{pipedes[0], POLLIN, 0}, {wrend, POLLOUT, 0}};
+            if (poll(pfd, 2, -1) < 0)
+            {
+                if (EINTR == errno)
+                    continue;
+                ERR("poll()");
+            }
+            if (pfd[1].revents)
+                channel_flush(&ch);
+            if (pfd[0].revents)
+                break;
+        }
+        gauge_poll(&gauge, pipedes[0]);
+        // a frame larger than PIPE_BUF may come in parts
+        TRACE_BEGIN("pipe read");
+        if ((status = bulk_read(pipedes[0], (char *)&hdr, offset)) < 0)
             ERR("read()");
         if (!status)
+        {
             // EOF - broken pipe
+            TRACE_END("pipe read");
             break;
-        if ((status = read(pipedes[0], buf + offset, size)) < size)
+        }
+        if (status < (ssize_t)offset || hdr.size < 0 || hdr.size > opts->max_payload ||
+            (status = bulk_read(pipedes[0], buf + offset, hdr.size)) < hdr.size)
             ERR("read()");
-        if (r > rand() % 100)
+        TRACE_END("pipe read");
+        hdr.stamp[1] = now_ns();
+        if (opts->r > rand() % 100)
         {
-            memcpy(buf + offset + size, message, length);
-            size += length;
+            memcpy(buf + offset + hdr.size, INJECTED, INJECTED_LEN);
+            hdr.size += INJECTED_LEN;
+            hdr.flags |= FRAME_INJECTED;
         }
-        memcpy(buf, &size, offset);
-        if (write(wrend, buf, size + offset) < 0)
-            ERR("write()");
+        memcpy(buf, &hdr, offset);
+        channel_write(&ch, buf, hdr.size + offset);
     } while (status > 0);
-    if (close(pipedes[0]) || close(wrend))
+    if (close(pipedes[0]))
         ERR("close()");
+    gauge_report(&gauge, "forwarder", producer);
+    channel_close(&ch, "forwarder", producer);
+    free(buf);
 }
 
-void first_generation(int t, int n, int r, int b)
+void latency_add(struct latency *lat, uint64_t from, uint64_t to)
 {
-    int pipedes[2];
-    if (pipe(pipedes))
-        ERR("pipe()");
-    for (int i = 0; i < 2; ++i)
+    uint64_t ns = to > from ? to - from : 0;
+    int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+    ++lat->histogram[bucket < HISTOGRAM ? bucket : HISTOGRAM - 1];
+    if (!lat->count || ns < lat->min)
+        lat->min = ns;
+    if (ns > lat->max)
+        lat->max = ns;
+    lat->sum += ns;
+    ++lat->count;
+}
+
+// Accounts one frame received by the root.
+void stats_frame(struct stats *st, const struct frame *hdr)
+{
+    if (hdr->producer >= st->children)
+    {
+        ++st->invalid;
+        return;
+    }
+    struct producer_stats *ps = &st->producer[hdr->producer];
+    if (!ps->frames++)
+        ps->first = hdr->stamp[2];
+    ps->last = hdr->stamp[2];
+    ps->bytes += hdr->size;
+    if (hdr->flags & FRAME_INJECTED)
+        ++ps->injected;
+    if (hdr->seq < ps->next_seq)
+        ++ps->reordered;
+    else
+    {
+        ps->lost += hdr->seq - ps->next_seq;
+        ps->next_seq = hdr->seq + 1;
+    }
+    latency_add(&st->hop[0], hdr->stamp[0], hdr->stamp[1]);
+    latency_add(&st->hop[1], hdr->stamp[1], hdr->stamp[2]);
+    latency_add(&st->hop[2], hdr->stamp[0], hdr->stamp[2]);
+}
+
+// Prints the statistics to stderr. At EOF frames that never arrived
+// after the last received sequence number are counted as lost too.
+void stats_report(struct stats *st, const struct options *opts, int final)
+{
+    static const char *hops[GENERATIONS] = {"producer->forwarder", "forwarder->root", "end-to-end"};
+    fprintf(stderr, "--- %s statistics ---\n", final ? "final" : "interim");
+    for (int i = 0; i < st->children; ++i)
+    {
+        struct producer_stats *ps = &st->producer[i];
+        long lost = ps->lost;
+        if (final && ps->next_seq < opts->n)
+            lost += opts->n - ps->next_seq;
+        double secs = (ps->last - ps->first) / 1e9;
+        fprintf(stderr, "producer %d: frames %ld bytes %ld injected %ld lost %ld reordered %ld",
+                i, ps->frames, ps->bytes, ps->injected, lost, ps->reordered);
+        if (secs > 0)
+            fprintf(stderr, " rate %.1f frames/s %.3f MB/s", (ps->frames - 1) / secs, ps->bytes / secs / 1e6);
+        fprintf(stderr, "\n");
+    }
+    if (st->invalid)
+        fprintf(stderr, "invalid headers: %ld\n", st->invalid);
+    for (int i = 0; i < st->children; ++i)
+        gauge_report(&st->gauge[i], "root", i);
+    for (int i = 0; i < GENERATIONS; ++i)
+    {
+        struct latency *lat = &st->hop[i];
+        if (!lat->count)
+            continue;
+        fprintf(stderr, "%s latency: min %.1fus avg %.1fus max %.1fus\n", hops[i],
+                lat->min / 1e3, lat->sum / 1e3 / lat->count, lat->max / 1e3);
+        for (int j = 0; j < HISTOGRAM; ++j)
+            if (lat->histogram[j])
+                fprintf(stderr, "  < %12.1fus: %ld\n", (double)(1ULL << j) / 1e3, lat->histogram[j]);
+    }
+}
+
+void sink_init(struct sink *sink, const struct options *opts)
+{
+    memset(sink, 0, sizeof(*sink));
+    sink->mode = opts->sink;
+    sink->max_payload = opts->max_payload;
+    sink->fd = STDOUT_FILENO;
+    if (opts->output && (sink->fd = open(opts->output, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        ERR("open()");
+}
+
+void sink_flush(struct sink *sink)
+{
+    static char close_bracket[] = "]\n";
+    if (sink->open)
+    {
+        sink->iov[sink->iovcnt].iov_base = close_bracket;
+        sink->iov[sink->iovcnt++].iov_len = sizeof(close_bracket) - 1;
+        sink->open = 0;
+    }
+    struct iovec *iov = sink->iov;
+    int iovcnt = sink->iovcnt;
+    TRACE_BEGIN("sink write");
+    while (iovcnt > 0)
+    {
+        ssize_t count = TEMP_FAILURE_RETRY(writev(sink->fd, iov, iovcnt));
+        if (count < 0)
+            ERR("writev()");
+        for (; iovcnt > 0 && count >= iov->iov_len; ++iov, --iovcnt)
+            count -= iov->iov_len;
+        if (iovcnt)
+        {
+            iov->iov_base = (char *)iov->iov_base + count;
+            iov->iov_len -= count;
+        }
+    }
+    TRACE_END("sink write");
+    sink->iovcnt = 0;
+}
+
+int frame_valid(const char *payload, int size, int max_payload)
+{
+    if (size <= 0 || size > max_payload + (int)INJECTED_LEN)
+        return 0;
+    for (int i = 0; i < size; ++i)
+        if (payload[i] < 'a' || payload[i] > 'z')
+            return 0;
+    return 1;
+}
+
+// Queues one frame (header followed by payload) for output.
+// The frame must stay in place until the next sink_flush().
+void sink_frame(struct sink *sink, char *frame, int size)
+{
+    char *payload = frame + sizeof(struct frame);
+    ++sink->frames;
+    sink->bytes += size;
+    switch (sink->mode)
+    {
+    case SINK_COUNT:
+        if (!frame_valid(payload, size, sink->max_payload))
+            ++sink->invalid;
+        return;
+    case SINK_BINARY:
+        if (sink->iovcnt + 1 > SINK_IOV)
+            sink_flush(sink);
+        sink->iov[sink->iovcnt].iov_base = frame;
+        sink->iov[sink->iovcnt++].iov_len = sizeof(struct frame) + size;
+        return;
+    case SINK_TEXT:
+        // one slot is kept for the closing bracket of the last record
+        if (sink->iovcnt + 3 > SINK_IOV)
+            sink_flush(sink);
+        char *hdr = sink->hdr[sink->iovcnt / 2];
+        int len = snprintf(hdr, SINK_HDR, "%s[%ld]: [%d]: [", sink->open ? "]\n" : "", sink->frames, size);
+        sink->iov[sink->iovcnt].iov_base = hdr;
+        sink->iov[sink->iovcnt++].iov_len = len;
+        sink->iov[sink->iovcnt].iov_base = payload;
+        sink->iov[sink->iovcnt++].iov_len = size;
+        sink->open = 1;
+        return;
+    }
+}
+
+void sink_close(struct sink *sink)
+{
+    sink_flush(sink);
+    if (SINK_COUNT == sink->mode)
+    {
+        char buf[128];
+        int len = snprintf(buf, sizeof(buf), "frames: %ld bytes: %ld invalid: %ld\n",
+                           sink->frames, sink->bytes, sink->invalid);
+        if (write(sink->fd, buf, len) < 0)
+            ERR("write()");
+    }
+    if (sink->fd != STDOUT_FILENO && close(sink->fd))
+        ERR("close()");
+}
+
+// Reads the frames of every forwarder from the one pipe they share.
+void merge_shared(int fd, struct sink *sink, struct stats *stats, const struct options *opts)
+{
+    struct frame hdr;
+    size_t offset = sizeof(hdr);
+    char *buf = malloc(SINK_BUF);
+    if (!buf)
+        ERR("malloc()");
+    size_t pos = 0, fill = 0;
+    for (;;)
+    {
+        if (SINK_BUF - fill < PIPE_BUF)
+        {
+            // only a partial frame is left behind by sink_flush()
+            memmove(buf, buf + pos, fill - pos);
+            fill -= pos;
+            pos = 0;
+        }
+        gauge_poll(&stats->gauge[0], fd);
+        TRACE_BEGIN("pipe read");
+        ssize_t count = read(fd, buf + fill, SINK_BUF - fill);
+        TRACE_END("pipe read");
+        if (report_requested)
+        {
+            report_requested = 0;
+            stats_report(stats, opts, 0);
+        }
+        if (count < 0)
+        {
+            if (EINTR == errno)
+                continue;
+            ERR("read()");
+        }
+        if (!count)
+            // EOF - broken pipe
+            break;
+        fill += count;
+        uint64_t received = now_ns();
+        while (fill - pos >= offset)
+        {
+            memcpy(&hdr, buf + pos, offset);
+            check_header(&hdr, frame_size(opts));
+            if (fill - pos - offset < hdr.size)
+                break;
+            hdr.stamp[2] = received;
+            memcpy(buf + pos, &hdr, offset);
+            stats_frame(stats, &hdr);
+            sink_frame(sink, buf + pos, hdr.size);
+            pos += offset + hdr.size;
+        }
+        sink_flush(sink);
+        if (pos == fill)
+            pos = fill = 0;
+    }
+    free(buf);
+}
+
+// Returns 1 if a whole frame is at the head of the inlet, with its header.
+int inlet_head(struct inlet *in, struct frame *hdr)
+{
+    if (in->fill - in->pos < sizeof(*hdr))
+        return 0;
+    memcpy(hdr, in->buf + in->pos, sizeof(*hdr));
+    check_header(hdr, in->frame);
+    return in->fill - in->pos - sizeof(*hdr) >= hdr->size;
+}
+
+// Reads what the pipe has, unless the buffer has no room for a whole
+// frame even after moving the unmerged data to its start. The sink must
+// have been flushed, since that moves the frames it points to.
+void inlet_read(reactor *r, struct inlet *in, struct gauge *gauge, int frame)
+{
+    if (in->size - in->fill < frame)
+    {
+        memmove(in->buf, in->buf + in->pos, in->fill - in->pos);
+        in->fill -= in->pos;
+        in->pos = 0;
+    }
+    if (in->size - in->fill < frame)
+    {
+        reactor_modify(r, &in->source, 0);
+        return;
+    }
+    // the level epoll found, before the read drains it
+    gauge_sample(gauge, in->source.fd, r->now);
+    TRACE_BEGIN("pipe read");
+    ssize_t count = read(in->source.fd, in->buf + in->fill, in->size - in->fill);
+    TRACE_END("pipe read");
+    if (count < 0)
+    {
+        if (EINTR == errno || EAGAIN == errno)
+            return;
+        ERR("read()");
+    }
+    if (!count)
+    {
+        // EOF - broken pipe; what is left is still merged
+        if (close(in->source.fd))
+            ERR("close()");
+        in->source.fd = -1;
+        return;
+    }
+    in->fill += count;
+}
+
+// Hands the frame at the head of the inlet over to the sink.
+void inlet_emit(struct inlet *in, struct frame *hdr, uint64_t now, struct sink *sink, struct stats *stats)
+{
+    hdr->stamp[2] = now;
+    memcpy(in->buf + in->pos, hdr, sizeof(*hdr));
+    stats_frame(stats, hdr);
+    sink_frame(sink, in->buf + in->pos, hdr->size);
+    in->pos += sizeof(*hdr) + hdr->size;
+    if (in->pos == in->fill)
+        in->pos = in->fill = 0;
+}
+
+// Emits the oldest head of all inlets for as long as no forwarder that is
+// still running could have produced an older frame: every open inlet has a
+// head, or the oldest one has waited for the window already. Returns when
+// the held frames are due, 0 if none are held.
+uint64_t merge_timestamps(struct inlet *inlets, int n, uint64_t now, struct sink *sink, struct stats *stats,
+                          const struct options *opts)
+{
+    uint64_t window = opts->window_ms * 1000000ULL;
+    for (;;)
+    {
+        int oldest = -1, waiting = 0;
+        struct frame hdr, first;
+        for (int i = 0; i < n; ++i)
+            if (!inlet_head(&inlets[i], &hdr))
+                waiting |= inlets[i].source.fd >= 0;
+            else if (oldest < 0 || hdr.stamp[0] < first.stamp[0])
+            {
+                oldest = i;
+                first = hdr;
+            }
+        if (oldest < 0)
+            return 0;
+        if (waiting && first.stamp[0] + window > now)
+            return first.stamp[0] + window;
+        inlet_emit(&inlets[oldest], &first, now, sink, stats);
+    }
+}
+
+// The root's end of a pipe per forwarder. The reactor reads the inlets as
+// they become readable and merges their frames after every batch.
+struct merger
+{
+    reactor reactor;
+    struct inlet inlets[MAX_CHILDREN];
+    int n, next, frame;
+    timer held;  // when the frames held back by the timestamp merge are due
+    struct sink *sink;
+    struct stats *stats;
+    const struct options *opts;
+};
+
+void merge_held(struct merger *m)
+{
+    uint64_t due = merge_timestamps(m->inlets, m->n, m->reactor.now, m->sink, m->stats, m->opts);
+    if (due)
+        reactor_timer(&m->reactor, &m->held, due);
+    else
+        reactor_cancel(&m->reactor, &m->held);
+}
+
+void held_due(reactor *r, timer *t)
+{
+    merge_held(container_of(t, struct merger, held));
+}
+
+void inlet_ready(reactor *r, source *s, uint32_t events)
+{
+    struct merger *m = container_of(r, struct merger, reactor);
+    struct inlet *in = container_of(s, struct inlet, source);
+    inlet_read(r, in, &m->stats->gauge[in - m->inlets], m->frame);
+    if (MERGE_ARRIVAL == m->opts->merge)
+    {
+        struct frame hdr;
+        while (inlet_head(in, &hdr))
+            inlet_emit(in, &hdr, r->now, m->sink, m->stats);
+    }
+}
+
+void merge_batch(reactor *r)
+{
+    struct merger *m = container_of(r, struct merger, reactor);
+    struct frame hdr;
+    if (MERGE_ROUND_ROBIN == m->opts->merge)
+    {
+        // a frame from every inlet in turn, starting one further each time
+        for (int emitted = 1; emitted;)
+        {
+            emitted = 0;
+            for (int i = 0; i < m->n; ++i)
+            {
+                struct inlet *in = &m->inlets[(m->next + i) % m->n];
+                if (inlet_head(in, &hdr))
+                {
+                    inlet_emit(in, &hdr, r->now, m->sink, m->stats);
+                    emitted = 1;
+                }
+            }
+        }
+        m->next = (m->next + 1) % m->n;
+    }
+    else if (MERGE_TIMESTAMP == m->opts->merge)
+        // with every forwarder ended, this emits what was held for them
+        merge_held(m);
+    sink_flush(m->sink);
+    int open = 0;
+    for (int i = 0; i < m->n; ++i)
+        if (m->inlets[i].source.fd >= 0)
+        {
+            ++open;
+            // a full inlet waits until the merge has taken a frame out
+            if (m->inlets[i].size - (m->inlets[i].fill - m->inlets[i].pos) >= m->frame)
+                reactor_modify(r, &m->inlets[i].source, EPOLLIN);
+        }
+    if (!open)
+        reactor_stop(r);
+}
+
+void merge_report(reactor *r, int sig)
+{
+    struct merger *m = container_of(r, struct merger, reactor);
+    stats_report(m->stats, m->opts, 0);
+}
+
+// Reads a pipe per forwarder and merges their frames in the chosen order.
+void merge_pipes(int (*pipes)[2], struct sink *sink, struct stats *stats, const struct options *opts)
+{
+    struct merger m = {.n = opts->children, .frame = frame_size(opts), .sink = sink, .stats = stats, .opts = opts};
+    reactor_init(&m.reactor);
+    m.reactor.after_batch = merge_batch;
+    reactor_signal(&m.reactor, SIGUSR1, merge_report);
+    timer_init(&m.held, held_due);
+    for (int i = 0; i < m.n; ++i)
+    {
+        struct inlet *in = &m.inlets[i];
+        in->frame = m.frame;
+        in->size = INLET_FRAMES * m.frame;
+        if (!(in->buf = malloc(in->size)))
+            ERR("malloc()");
+        reactor_add(&m.reactor, &in->source, pipes[i][0], EPOLLIN, inlet_ready);
+    }
+    reactor_run(&m.reactor);
+    reactor_destroy(&m.reactor);
+    for (int i = 0; i < m.n; ++i)
+        free(m.inlets[i].buf);
+}
+
+void first_generation(const struct options *opts)
+{
+    // one pipe shared by the forwarders, or one each
+    int pipes[MAX_CHILDREN][2];
+    int shared = MERGE_SHARED == opts->merge;
+    int npipes = shared ? 1 : opts->children;
+    for (int i = 0; i < npipes; ++i)
+        make_pipe(pipes[i], opts->root_pipe);
+    for (int i = 0; i < opts->children; ++i)
     {
         switch (fork())
         {
         case -1:
             ERR("fork()");
         case 0:
-            if (close(pipedes[0]))
-                ERR("close()");
-            second_generation(pipedes[1], t, n, r, b);
+            for (int j = 0; j < npipes; ++j)
+                if (close(pipes[j][0]) || (j != (shared ? 0 : i) && close(pipes[j][1])))
+                    ERR("close()");
+            second_generation(pipes[shared ? 0 : i][1], i, opts);
             exit(EXIT_SUCCESS);
         }
     }
-    if (close(pipedes[1]))
-        ERR("close()");
-    ssize_t status;
-    int size;
-    size_t offset = sizeof(size);
-    char buf[PIPE_BUF];
-    int count = 0;
-    do
+    for (int i = 0; i < npipes; ++i)
+        if (close(pipes[i][1]))
+            ERR("close()");
+    set_handler(report_handler, SIGUSR1);
+    struct sink sink;
+    sink_init(&sink, opts);
+    struct stats stats;
+    memset(&stats, 0, sizeof(stats));
+    stats.children = opts->children;
+    for (int i = 0; i < npipes; ++i)
+        gauge_init(&stats.gauge[i], pipes[i][0], opts->gauge_ms);
+    if (shared)
     {
-        if ((status = read(pipedes[0], &size, offset)) < 0)
-            ERR("read()");
-        if (!status)
-            // EOF - broken pipe
-            break;
-        if ((status = read(pipedes[0], buf, size)) < size)
-            ERR("read()");
-        buf[size] = 0;
-        printf("[%d]: [%d]: [%s]\n", ++count, size, buf + offset);
-    } while (status > 0);
-    if (close(pipedes[0]))
-        ERR("close()");
+        merge_shared(pipes[0][0], &sink, &stats, opts);
+        if (close(pipes[0][0]))
+            ERR("close()");
+    }
+    else
+        merge_pipes(pipes, &sink, &stats, opts);
+    sink_close(&sink);
+    stats_report(&stats, opts, 1);
+}
+
+void parse_merge(char *name, char *arg, struct options *opts)
+{
+    if (!strcmp(arg, "shared"))
+        opts->merge = MERGE_SHARED;
+    else if (!strcmp(arg, "arrival"))
+        opts->merge = MERGE_ARRIVAL;
+    else if (!strcmp(arg, "round-robin"))
+        opts->merge = MERGE_ROUND_ROBIN;
+    else if (!strcmp(arg, "timestamp"))
+        opts->merge = MERGE_TIMESTAMP;
+    else if (!strncmp(arg, "timestamp:", 10) && (opts->window_ms = atoi(arg + 10)) >= 0)
+        opts->merge = MERGE_TIMESTAMP;
+    else
+        usage(name);
+}
+
+void parse_sink(char *name, char *arg, struct options *opts)
+{
+    if (!strcmp(arg, "text"))
+        opts->sink = SINK_TEXT;
+    else if (!strcmp(arg, "binary"))
+        opts->sink = SINK_BINARY;
+    else if (!strcmp(arg, "count"))
+        opts->sink = SINK_COUNT;
+    else
+        usage(name);
+}
+
+void parse_policy(char *name, char *arg, struct options *opts)
+{
+    if (!strcmp(arg, "block"))
+        opts->policy = POLICY_BLOCK;
+    else if (!strcmp(arg, "drop-newest"))
+        opts->policy = POLICY_DROP_NEWEST;
+    else if (!strcmp(arg, "drop-oldest"))
+        opts->policy = POLICY_DROP_OLDEST;
+    else
+        usage(name);
+}
+
+void parse_arrival(char *name, char *arg, struct options *opts)
+{
+    if (!strcmp(arg, "const"))
+        opts->arrival = ARRIVAL_CONST;
+    else if (!strcmp(arg, "poisson"))
+        opts->arrival = ARRIVAL_POISSON;
+    else if (!strncmp(arg, "burst:", 6) && (opts->burst = atoi(arg + 6)) > 0)
+        opts->arrival = ARRIVAL_BURST;
+    else
+        usage(name);
 }
 
 int main(int argc, char **argv)
 {
+    err_kill_group = 1;
     set_handler(SIG_IGN, SIGINT);
-    if (argc != 5)
+    struct options opts = {.fps = -1, .arrival = ARRIVAL_CONST, .burst = 1, .gauge_ms = 10, .children = CHILDREN,
+                           .merge = MERGE_SHARED, .window_ms = MERGE_WINDOW_MS, .max_payload = MAX_PAYLOAD};
+    int c;
+    while ((c = getopt(argc, argv, "f:y:a:o:O:p:P:d:g:c:m:s:")) != -1)
+        switch (c)
+        {
+        case 'c':
+            if ((opts.children = atoi(optarg)) < 1 || opts.children > MAX_CHILDREN)
+                usage(argv[0]);
+            break;
+        case 'm':
+            parse_merge(argv[0], optarg, &opts);
+            break;
+        case 's':
+            if ((opts.max_payload = atoi(optarg)) < 1 || opts.max_payload > MAX_LARGE_PAYLOAD)
+                usage(argv[0]);
+            break;
+        case 'f':
+            if ((opts.fps = atof(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'y':
+            if ((opts.bps = atof(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'a':
+            parse_arrival(argv[0], optarg, &opts);
+            break;
+        case 'o':
+            opts.output = optarg;
+            break;
+        case 'O':
+            parse_sink(argv[0], optarg, &opts);
+            break;
+        case 'p':
+            if ((opts.producer_pipe = atoi(optarg)) < PIPE_BUF)
+                usage(argv[0]);
+            break;
+        case 'P':
+            if ((opts.root_pipe = atoi(optarg)) < PIPE_BUF)
+                usage(argv[0]);
+            break;
+        case 'd':
+            parse_policy(argv[0], optarg, &opts);
+            break;
+        case 'g':
+            if ((opts.gauge_ms = atoi(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    if (argc - optind != 4)
+        usage(argv[0]);
+    char **args = argv + optind;
+    opts.t = atoi(args[0]), opts.n = atoi(args[1]), opts.r = atoi(args[2]), opts.b = atoi(args[3]);
+    if (!(0 <= opts.t && opts.t <= 500 && 3 <= opts.n && 0 <= opts.r && opts.r <= 100 && 1 <= opts.b &&
+          opts.b <= opts.max_payload))
         usage(argv[0]);
-    int t = atoi(argv[1]), n = atoi(argv[2]), r = atoi(argv[3]), b = atoi(argv[4]);
-    if (!(50 <= t && t <= 500 && 3 <= n && n <= 30 && 0 <= r && r <= 100 && 1 <= b && b <= PIPE_BUF - 6))
+    // frames written by several processes into one pipe only stay whole up to PIPE_BUF
+    if (MERGE_SHARED == opts.merge && opts.max_payload > MAX_PAYLOAD)
         usage(argv[0]);
-    first_generation(t, n, r, b);
+    // a byte rate alone paces the frames by their size
+    if (opts.fps < 0)
+        opts.fps = opts.t && !opts.bps ? 1000.0 / opts.t : 0;
+    if (opts.producer_pipe)
+        opts.producer_pipe = pipe_capacity(opts.producer_pipe);
+    if (opts.root_pipe)
+        opts.root_pipe = pipe_capacity(opts.root_pipe);
+    first_generation(&opts);
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,104 @@
+#ifndef QUEUE_CHANNEL_H
+#define QUEUE_CHANNEL_H
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buffer.h"
+
+// A downstream channel is a ring in shared memory, <q0_name>.down.<i>, that
+// prog1 broadcasts the "check status" messages of many clients on. Every
+// client maps its channel read-only, follows the ring with a cursor of its
+// own and keeps the messages addressed to its pid. A client that falls a
+// whole ring behind skips what it lost.
+
+#define CHANNEL_MAGIC 0x4e414843u  // "CHAN"
+#define CHANNEL_SLOTS (1 << 16)
+#define CHANNEL_MSGSIZE 50
+
+struct channel_slot
+{
+    // position + 1 once written, 0 while being written
+    _Atomic uint64_t seq;
+    pid_t pid;
+    char msg[CHANNEL_MSGSIZE];
+};
+
+struct channel
+{
+    uint32_t magic;
+    int channels;
+    // bumped after every batch of messages, the word readers sleep on
+    alignas(CACHE_LINE) _Atomic uint32_t futex;
+    alignas(CACHE_LINE) _Atomic uint64_t head;
+    struct channel_slot slots[CHANNEL_SLOTS];
+};
+
+static inline void channel_name(char *buf, size_t size, const char *q0_name, int channel)
+{
+    snprintf(buf, size, "%s.down.%d", q0_name, channel);
+}
+
+// The channel has a single writer.
+static inline void channel_publish(struct channel *ch, pid_t pid, const char *msg)
+{
+    uint64_t pos = atomic_load_explicit(&ch->head, memory_order_relaxed);
+    struct channel_slot *slot = &ch->slots[pos % CHANNEL_SLOTS];
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->pid = pid;
+    snprintf(slot->msg, sizeof(slot->msg), "%s", msg);
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    atomic_store_explicit(&ch->head, pos + 1, memory_order_release);
+}
+
+static inline void channel_wake(struct channel *ch)
+{
+    atomic_fetch_add_explicit(&ch->futex, 1, memory_order_release);
+    syscall(SYS_futex, &ch->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// Copies the next message for pid into buf; returns 0 if there is none yet.
+static inline int channel_read(struct channel *ch, uint64_t *cursor, pid_t pid, char *buf)
+{
+    uint64_t head = atomic_load_explicit(&ch->head, memory_order_acquire);
+    if (head - *cursor > CHANNEL_SLOTS)
+        *cursor = head - CHANNEL_SLOTS;
+    for (; *cursor < head; ++*cursor)
+    {
+        struct channel_slot *slot = &ch->slots[*cursor % CHANNEL_SLOTS];
+        uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (slot->pid != pid)
+            continue;
+        char msg[CHANNEL_MSGSIZE];
+        memcpy(msg, slot->msg, sizeof(msg));
+        atomic_thread_fence(memory_order_acquire);
+        // the writer lapped the reader while it copied
+        if (seq != *cursor + 1 || atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq)
+            continue;
+        msg[CHANNEL_MSGSIZE - 1] = 0;
+        memcpy(buf, msg, sizeof(msg));
+        ++*cursor;
+        return 1;
+    }
+    return 0;
+}
+
+// Sleeps until the channel moves past seen or the absolute CLOCK_REALTIME
+// deadline passes, like mq_timedreceive.
+static inline int channel_wait(struct channel *ch, uint32_t seen, const struct timespec *deadline)
+{
+    return syscall(SYS_futex, &ch->futex, FUTEX_WAIT_BITSET | FUTEX_CLOCK_REALTIME, seen, deadline, NULL,
+                   FUTEX_BITSET_MATCH_ANY);
+}
+
+#endif
@@ -1,43 +1,237 @@
 #define _GNU_SOURCE
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <mqueue.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "channel.h"
+#include "shard.h"
+#include "trace.h"
+#include "util.h"
+
 #define MSGSIZE 50
 #define REGISTER 0
 #define STATUS 1
-
-#define ERR(source) (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
-                     perror(source), kill(0, SIGKILL),               \
-                     exit(EXIT_FAILURE))
+#define SHARD_MAXMSG 1024  // lowered to what the system allows
+#define RECEIVE_TIMEOUT_MS 100
+#define REGISTRY_STRIPES 64
+#define DRAIN_BATCH 64
+#define CLIENT_BACKLOG 64
+#define MAX_WEIGHT 100
+#define DELAY_BUCKETS 32
+#define MAX_CHANNELS 64
+#define PROBE_BATCH 16  // subscribers a broadcaster checks for life per round
 
 volatile sig_atomic_t last_signal = 0;
+volatile sig_atomic_t stats_requests = 0;
+
+// The clients registered so far, in stripes locked independently. A
+// client only ever sends to its own shard, so dispatchers rarely meet on
+// a stripe; the lock keeps a client that registers twice, or on another
+// shard, from getting a second child.
+struct stripe
+{
+    pthread_mutex_t mutex;
+    pid_t *pids;
+    int count, capacity;
+};
+
+struct stripe registry[REGISTRY_STRIPES];
+
+struct pending
+{
+    uint64_t sent;  // stamped by the client, or taken off the queue if it does not
+    char msg[MSGSIZE];
+};
+
+// The status messages of a client waiting for their turn, and how long
+// the served ones waited. A client that floods the server overflows its
+// own backlog and loses its oldest messages, not anyone else's.
+struct client
+{
+    pid_t pid;
+    int index;  // in the clients of the shard
+    int weight;
+    int deficit;
+    int head, count;
+    struct pending backlog[CLIENT_BACKLOG];
+    long served, dropped;
+    uint64_t delay_sum, delay_max;
+    long delays[DELAY_BUCKETS];  // by log2 of the delay in microseconds
+};
+
+// A shard queue and the dispatcher thread serving it. The dispatcher
+// empties the kernel queue into the backlogs of its clients and serves
+// them by deficit round-robin: a round gives every client with a backlog
+// as many messages as its weight.
+struct shard
+{
+    int index;
+    int t;
+    mqd_t mqdes;
+    char name[NAME_MAX + 1];
+    pthread_t thread;
+    struct client **clients;  // in serving order
+    int count, capacity;
+    struct client **table;    // by pid, open addressing, at most half full
+    unsigned table_mask;
+    int pending;
+    sig_atomic_t stats_seen;
+    // clients a broadcaster found dead, forgotten by the dispatcher, the
+    // only thread that walks the clients
+    pthread_mutex_t gone_mutex;
+    pid_t *gone;
+    int gone_count, gone_capacity;
+};
+
+struct shard *shards;
+int shard_count;
+
+struct subscriber
+{
+    pid_t pid;
+    int sent;
+};
+
+// A downstream channel and the thread that sends the "check status"
+// messages of its subscribers on it every t ms, in place of a child and
+// a queue per client.
+struct downstream
+{
+    int t;
+    char name[NAME_MAX + 1];
+    struct channel *ch;
+    pthread_mutex_t mutex;
+    struct subscriber *subscribers;
+    int count, capacity;
+    int probe;  // the next subscriber checked for life
+    pthread_t thread;
+};
+
+struct downstream *downstreams;
+int downstream_count;
+
+// Without channels every client gets a child sending its "check status"
+// messages. A child forked by a dispatcher thread could only make
+// async-signal-safe calls, so the children come from a spawner instead:
+// a single-threaded process started before the dispatchers, which takes
+// its orders from a pipe. An order is smaller than PIPE_BUF, so the
+// dispatchers write theirs whole without a lock.
+enum spawn_op
+{
+    SPAWN_START,
+    SPAWN_STOP
+};
+
+struct spawn_order
+{
+    int op;
+    pid_t pid;
+};
+
+int spawner_fd = -1;
 
 void usage(char *name)
 {
-    fprintf(stderr, "USAGE: %s q0_name t\n", name);
+    fprintf(stderr, "USAGE: %s [-k shards] [-m channels] q0_name t\n", name);
     fprintf(stderr, "USAGE: q0_name matches \"/[A-Za-z0-9._-]+\"\n");
     fprintf(stderr, "USAGE: t belongs to [100, 2000]\n");
+    fprintf(stderr, "USAGE: shards belongs to [1, %d], one per online core by default\n", MAX_SHARDS);
+    fprintf(stderr, "USAGE: channels belongs to [1, %d], shared downstream channels instead of a queue per client\n",
+            MAX_CHANNELS);
+    fprintf(stderr, "USAGE: SIGUSR1 prints the messages served per client and their delay\n");
     exit(EXIT_FAILURE);
 }
 
-void set_handler(void (*f)(int), int sig)
+void sig_handler(int sig)
 {
-    struct sigaction act;
-    memset(&act, 0, sizeof(act));
-    act.sa_handler = f;
-    if (sigaction(sig, &act, NULL) < 0)
-        ERR("sigaction()");
+    if (SIGUSR1 == sig)
+        ++stats_requests;
+    else
+        last_signal = sig;
 }
 
-void sig_handler(int sig)
+// Returns true if pid was not registered yet.
+bool register_client(pid_t pid)
+{
+    struct stripe *s = &registry[(uint32_t)pid % REGISTRY_STRIPES];
+    bool added = true;
+    pthread_mutex_lock(&s->mutex);
+    for (int i = 0; i < s->count && added; ++i)
+        added = s->pids[i] != pid;
+    if (added)
+    {
+        if (s->count == s->capacity)
+        {
+            s->capacity = s->capacity ? 2 * s->capacity : 16;
+            if (!(s->pids = realloc(s->pids, s->capacity * sizeof(*s->pids))))
+                ERR("realloc");
+        }
+        s->pids[s->count++] = pid;
+    }
+    pthread_mutex_unlock(&s->mutex);
+    return added;
+}
+
+// Returns true if pid was registered.
+bool unregister_client(pid_t pid)
+{
+    struct stripe *s = &registry[(uint32_t)pid % REGISTRY_STRIPES];
+    bool removed = false;
+    pthread_mutex_lock(&s->mutex);
+    for (int i = 0; i < s->count && !removed; ++i)
+        if ((removed = s->pids[i] == pid))
+            s->pids[i] = s->pids[--s->count];
+    pthread_mutex_unlock(&s->mutex);
+    return removed;
+}
+
+// One write per line, so that dispatchers never interleave or contend
+// on the lock of stdout.
+void print_line(const char *msg)
+{
+    char line[128];
+    int len = snprintf(line, sizeof(line), "%s\n", msg);
+    if (len >= (int)sizeof(line))
+        len = sizeof(line) - 1;
+    if (bulk_write(STDOUT_FILENO, line, len) < 0)
+        ERR("write");
+}
+
+void deadline(struct timespec *ts, int ms)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_nsec += ms * 1000000L;
+    ts->tv_sec += ts->tv_nsec / 1000000000;
+    ts->tv_nsec %= 1000000000;
+}
+
+// Sends the "unregister" of a client killed before it could, found out by
+// its child from the messages it stopped taking.
+void unregister_gone(pid_t pid, int t)
 {
-    last_signal = sig;
+    mqd_t mqdes = mq_open(shards[shard_of(pid, shard_count)].name, O_WRONLY);
+    if (-1 == mqdes)
+        // prog1 has stopped
+        return;
+    char buf[MSGSIZE];
+    snprintf(buf, sizeof(buf), "unregister %d", pid);
+    struct timespec ts;
+    deadline(&ts, t);
+    TEMP_FAILURE_RETRY(mq_timedsend(mqdes, buf, sizeof(buf), REGISTER, &ts));
+    mq_close(mqdes);
 }
 
 void child_work(int pid, int t)
@@ -58,87 +252,665 @@ void child_work(int pid, int t)
         st.tv_sec += t / 1000;
     else
         st.tv_nsec = t * 1000000;
-    for (int i = 0; last_signal != SIGINT; ++i)
+    bool gone = false;
+    for (int i = 0; last_signal != SIGINT && !gone; ++i)
     {
         char buf[MSGSIZE];
         snprintf(buf, sizeof(buf), "check status [%d]", i);
-        TEMP_FAILURE_RETRY(mq_send(mqdes, buf, sizeof(buf), STATUS));
+        TRACE_BEGIN("send");
+        // timed, so that SIGINT or a client that has gone is noticed
+        struct timespec ts;
+        deadline(&ts, t);
+        while (!gone && mq_timedsend(mqdes, buf, sizeof(buf), STATUS, &ts) && last_signal != SIGINT)
+        {
+            if (errno != EINTR && errno != ETIMEDOUT)
+                ERR("mq_timedsend");
+            gone = kill(pid, 0) && ESRCH == errno;
+            deadline(&ts, t);
+        }
+        TRACE_END("send");
         nanosleep(&st, NULL);
     }
 
     mq_close(mqdes);
     if (mq_unlink(name))
         ERR("mq_unlink");
+    if (gone)
+        unregister_gone(pid, t);
 }
 
-void parent_work(mqd_t mqdes, int t)
+void subscribe(pid_t pid)
 {
-    for (; last_signal != SIGINT;)
+    struct downstream *d = &downstreams[shard_of(pid, downstream_count)];
+    pthread_mutex_lock(&d->mutex);
+    if (d->count == d->capacity)
     {
-        char buf[MSGSIZE];
-        unsigned msg_prio;
-        if (TEMP_FAILURE_RETRY(mq_receive(mqdes, buf, sizeof(buf), &msg_prio)) == -1)
+        d->capacity = d->capacity ? 2 * d->capacity : 16;
+        if (!(d->subscribers = realloc(d->subscribers, d->capacity * sizeof(*d->subscribers))))
+            ERR("realloc");
+    }
+    d->subscribers[d->count++] = (struct subscriber){.pid = pid, .sent = 0};
+    pthread_mutex_unlock(&d->mutex);
+}
+
+void order_child(int op, pid_t pid)
+{
+    struct spawn_order order = {op, pid};
+    if (bulk_write(spawner_fd, (char *)&order, sizeof(order)) < 0)
+        ERR("write");
+}
+
+// Starts and stops the children until prog1 closes the pipe, then stops
+// the ones left.
+void spawner_work(int fd, int t)
+{
+    struct
+    {
+        pid_t client, child;
+    } *children = NULL;
+    int count = 0, capacity = 0;
+    struct spawn_order order;
+    ssize_t status;
+    while ((status = bulk_read(fd, (char *)&order, sizeof(order))) == sizeof(order))
+    {
+        if (SPAWN_START == order.op)
         {
-            if (EAGAIN == errno)
-                continue;
-            ERR("mq_receive");
+            if (count == capacity)
+            {
+                capacity = capacity ? 2 * capacity : 16;
+                if (!(children = realloc(children, capacity * sizeof(*children))))
+                    ERR("realloc");
+            }
+            pid_t child = fork();
+            if (child < 0)
+                ERR("fork()");
+            if (!child)
+            {
+                free(children);
+                child_work(order.pid, t);
+                exit(EXIT_SUCCESS);
+            }
+            children[count].client = order.pid;
+            children[count++].child = child;
         }
+        else
+            for (int i = 0; i < count; ++i)
+                if (children[i].client == order.pid)
+                {
+                    kill(children[i].child, SIGINT);
+                    children[i] = children[--count];
+                    break;
+                }
+        // a child whose client has gone may stop before its order
+        pid_t done;
+        while ((done = waitpid(-1, NULL, WNOHANG)) > 0)
+            for (int i = 0; i < count; ++i)
+                if (children[i].child == done)
+                {
+                    children[i] = children[--count];
+                    break;
+                }
+    }
+    if (status < 0)
+        ERR("read");
+    for (int i = 0; i < count; ++i)
+        kill(children[i].child, SIGINT);
+    while (wait(NULL) > 0)
+        ;
+    free(children);
+}
 
-        char msg[MSGSIZE];
-        strcpy(msg, buf);
-        char *token = strtok(buf, " ");
+void start_spawner(int t)
+{
+    int pipedes[2];
+    if (pipe2(pipedes, O_CLOEXEC))
+        ERR("pipe2");
+    switch (fork())
+    {
+    case -1:
+        ERR("fork()");
+    case 0:
+        if (close(pipedes[1]))
+            ERR("close");
+        spawner_work(pipedes[0], t);
+        exit(EXIT_SUCCESS);
+    }
+    if (close(pipedes[0]))
+        ERR("close");
+    spawner_fd = pipedes[1];
+}
 
-        if (strcmp(token, "status") == 0 && STATUS == msg_prio)
+void unsubscribe(pid_t pid)
+{
+    struct downstream *d = &downstreams[shard_of(pid, downstream_count)];
+    pthread_mutex_lock(&d->mutex);
+    for (int i = 0; i < d->count; ++i)
+        if (d->subscribers[i].pid == pid)
         {
-            printf("%s\n", msg);
-            fflush(stdout);
+            d->subscribers[i] = d->subscribers[--d->count];
+            break;
         }
+    pthread_mutex_unlock(&d->mutex);
+}
 
-        else if (strcmp(token, "register") == 0 && REGISTER == msg_prio)
+void report_gone(pid_t pid)
+{
+    struct shard *shard = &shards[shard_of(pid, shard_count)];
+    pthread_mutex_lock(&shard->gone_mutex);
+    if (shard->gone_count == shard->gone_capacity)
+    {
+        shard->gone_capacity = shard->gone_capacity ? 2 * shard->gone_capacity : 16;
+        if (!(shard->gone = realloc(shard->gone, shard->gone_capacity * sizeof(*shard->gone))))
+            ERR("realloc");
+    }
+    shard->gone[shard->gone_count++] = pid;
+    pthread_mutex_unlock(&shard->gone_mutex);
+}
+
+void *broadcaster(void *arg)
+{
+    struct downstream *d = arg;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (last_signal != SIGINT)
+    {
+        next.tv_nsec += d->t * 1000000L;
+        next.tv_sec += next.tv_nsec / 1000000000;
+        next.tv_nsec %= 1000000000;
+        if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+            continue;
+
+        TRACE_BEGIN("broadcast");
+        pthread_mutex_lock(&d->mutex);
+        // a publication cannot fail, so a client killed before it could
+        // unregister is found by a few probes per round, going round them all
+        for (int i = 0; i < PROBE_BATCH && d->count; ++i)
         {
-            printf("%s\n", msg);
-            fflush(stdout);
-            token = strtok(NULL, " ");
-            int pid = strtol(token, NULL, 10);
+            if (d->probe >= d->count)
+                d->probe = 0;
+            pid_t pid = d->subscribers[d->probe].pid;
+            if (kill(pid, 0) && ESRCH == errno)
+            {
+                unregister_client(pid);
+                report_gone(pid);
+                d->subscribers[d->probe] = d->subscribers[--d->count];
+            }
+            else
+                ++d->probe;
+        }
+        for (int i = 0; i < d->count; ++i)
+        {
+            char buf[MSGSIZE];
+            snprintf(buf, sizeof(buf), "check status [%d]", d->subscribers[i].sent++);
+            channel_publish(d->ch, d->subscribers[i].pid, buf);
+        }
+        int count = d->count;
+        pthread_mutex_unlock(&d->mutex);
+        if (count)
+            channel_wake(d->ch);
+        TRACE_END("broadcast");
+    }
+    return NULL;
+}
+
+// The pids of a shard share the bits shard_of() took, so they are mixed
+// again before they pick a slot.
+unsigned client_slot(struct shard *shard, pid_t pid)
+{
+    uint32_t h = (uint32_t)pid * 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    unsigned slot = h & shard->table_mask;
+    while (shard->table[slot] && shard->table[slot]->pid != pid)
+        slot = (slot + 1) & shard->table_mask;
+    return slot;
+}
+
+// Doubles the table once it is half full and puts every client back.
+void grow_table(struct shard *shard)
+{
+    if (shard->table && 2 * (shard->count + 1) <= (int)shard->table_mask + 1)
+        return;
+    shard->table_mask = shard->table ? 2 * shard->table_mask + 1 : 31;
+    free(shard->table);
+    if (!(shard->table = calloc(shard->table_mask + 1, sizeof(*shard->table))))
+        ERR("calloc");
+    for (int i = 0; i < shard->count; ++i)
+        shard->table[client_slot(shard, shard->clients[i]->pid)] = shard->clients[i];
+}
+
+struct client *find_client(struct shard *shard, pid_t pid)
+{
+    grow_table(shard);
+    unsigned slot = client_slot(shard, pid);
+    if (shard->table[slot])
+        return shard->table[slot];
+    if (shard->count == shard->capacity)
+    {
+        shard->capacity = shard->capacity ? 2 * shard->capacity : 16;
+        if (!(shard->clients = realloc(shard->clients, shard->capacity * sizeof(*shard->clients))))
+            ERR("realloc");
+    }
+    struct client *client = calloc(1, sizeof(*client));
+    if (!client)
+        ERR("calloc");
+    client->pid = pid;
+    client->weight = 1;
+    client->index = shard->count;
+    shard->table[slot] = client;
+    return shard->clients[shard->count++] = client;
+}
+
+// Empties the slot of a client and moves back the clients probed past it,
+// so no lookup stops at the hole.
+void remove_slot(struct shard *shard, unsigned hole)
+{
+    shard->table[hole] = NULL;
+    for (unsigned slot = (hole + 1) & shard->table_mask; shard->table[slot];
+         slot = (slot + 1) & shard->table_mask)
+    {
+        struct client *client = shard->table[slot];
+        shard->table[slot] = NULL;
+        shard->table[client_slot(shard, client->pid)] = client;
+    }
+}
 
-            switch (fork())
+void enqueue(struct shard *shard, struct client *client, const char *msg, uint64_t sent)
+{
+    if (CLIENT_BACKLOG == client->count)
+    {
+        client->head = (client->head + 1) % CLIENT_BACKLOG;
+        --client->count;
+        --shard->pending;
+        ++client->dropped;
+    }
+    struct pending *p = &client->backlog[(client->head + client->count) % CLIENT_BACKLOG];
+    p->sent = sent ? sent : now_ns();
+    snprintf(p->msg, sizeof(p->msg), "%s", msg);
+    ++client->count;
+    ++shard->pending;
+}
+
+void serve(struct shard *shard, struct client *client)
+{
+    struct pending *p = &client->backlog[client->head];
+    client->head = (client->head + 1) % CLIENT_BACKLOG;
+    --client->count;
+    --shard->pending;
+
+    TRACE_BEGIN("serve");
+    print_line(p->msg);
+    TRACE_END("serve");
+
+    uint64_t now = now_ns(), delay = now > p->sent ? now - p->sent : 0;
+    int bucket = 0;
+    for (uint64_t us = delay / 1000; us > 1 && bucket < DELAY_BUCKETS - 1; us >>= 1)
+        ++bucket;
+    ++client->delays[bucket];
+    ++client->served;
+    client->delay_sum += delay;
+    if (delay > client->delay_max)
+        client->delay_max = delay;
+}
+
+void serve_round(struct shard *shard)
+{
+    for (int i = 0; i < shard->count; ++i)
+    {
+        struct client *client = shard->clients[i];
+        if (!client->count)
+            continue;
+        client->deficit += client->weight;
+        while (client->deficit > 0 && client->count)
+        {
+            serve(shard, client);
+            --client->deficit;
+        }
+        // an idle client does not save up its turns
+        if (!client->count)
+            client->deficit = 0;
+    }
+}
+
+// The delay of a client's messages from the client sending them to
+// printing them, p99 rounded up to a power of two but not past the max.
+void print_stats(struct shard *shard)
+{
+    for (int i = 0; i < shard->count; ++i)
+    {
+        struct client *client = shard->clients[i];
+        long seen = 0, p99 = 0;
+        for (int b = 0; b < DELAY_BUCKETS && seen * 100 < client->served * 99; ++b)
+        {
+            seen += client->delays[b];
+            p99 = 2L << b;
+        }
+        if (p99 > (long)(client->delay_max / 1000))
+            p99 = client->delay_max / 1000;
+        char line[128];
+        snprintf(line, sizeof(line), "stats %d weight %d served %ld dropped %ld delay avg %ldus p99 %ldus max %ldus",
+                 client->pid, client->weight, client->served, client->dropped,
+                 client->served ? (long)(client->delay_sum / client->served / 1000) : 0L, p99,
+                 (long)(client->delay_max / 1000));
+        print_line(line);
+    }
+}
+
+void register_message(struct shard *shard, char *buf)
+{
+    int pid = 0, weight = 1;
+    // older clients register without a weight
+    if (sscanf(buf, "register %d %d", &pid, &weight) < 1 || pid <= 0)
+        return;
+    find_client(shard, pid)->weight = weight < 1 ? 1 : weight > MAX_WEIGHT ? MAX_WEIGHT : weight;
+
+    if (!register_client(pid))
+        return;
+    if (downstream_count)
+        subscribe(pid);
+    else
+        order_child(SPAWN_START, pid);
+}
+
+// Serves what the client has sent and drops it from the shard.
+void forget_client(struct shard *shard, pid_t pid)
+{
+    if (!shard->table)
+        return;
+    unsigned slot = client_slot(shard, pid);
+    struct client *client = shard->table[slot];
+    if (!client)
+        return;
+    while (client->count)
+        serve(shard, client);
+    remove_slot(shard, slot);
+    shard->clients[client->index] = shard->clients[--shard->count];
+    shard->clients[client->index]->index = client->index;
+    free(client);
+}
+
+// A client that stops sends "unregister <pid>". What it sent before is
+// still served, then it is forgotten everywhere, so that its pid may
+// register again once reused.
+void unregister_message(struct shard *shard, char *buf)
+{
+    int pid = strtol(buf + strlen("unregister "), NULL, 10);
+    if (pid <= 0)
+        return;
+    unregister_client(pid);
+    if (downstream_count)
+        unsubscribe(pid);
+    forget_client(shard, pid);
+    if (!downstream_count)
+        order_child(SPAWN_STOP, pid);
+}
+
+void forget_gone(struct shard *shard)
+{
+    pthread_mutex_lock(&shard->gone_mutex);
+    for (int i = 0; i < shard->gone_count; ++i)
+        forget_client(shard, shard->gone[i]);
+    shard->gone_count = 0;
+    pthread_mutex_unlock(&shard->gone_mutex);
+}
+
+void open_channel(struct downstream *d, int channels)
+{
+    int fd = shm_open(d->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        ERR("shm_open");
+    if (ftruncate(fd, sizeof(*d->ch)))
+        ERR("ftruncate");
+    if ((d->ch = mmap(NULL, sizeof(*d->ch), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+        ERR("mmap");
+    if (close(fd))
+        ERR("close");
+    d->ch->channels = channels;
+    // clients check the magic last, once the rest is in place
+    atomic_thread_fence(memory_order_release);
+    d->ch->magic = CHANNEL_MAGIC;
+    if (pthread_mutex_init(&d->mutex, NULL))
+        ERR("pthread_mutex_init");
+}
+
+// Takes whatever the shard queue holds, up to a batch, waiting for the
+// first message only if nothing is left to serve.
+void drain(struct shard *shard)
+{
+    for (int i = 0; i < DRAIN_BATCH; ++i)
+    {
+        char buf[MSGSIZE];
+        unsigned msg_prio;
+        // a deadline in the past returns at once from an empty queue
+        struct timespec ts = {0, 0};
+        if (0 == i && !shard->pending)
+            // the timeout lets the dispatcher notice SIGINT, taken by the main thread
+            deadline(&ts, RECEIVE_TIMEOUT_MS);
+        if (mq_timedreceive(shard->mqdes, buf, sizeof(buf), &msg_prio, &ts) == -1)
+        {
+            if (ETIMEDOUT == errno || EINTR == errno)
+                return;
+            ERR("mq_timedreceive");
+        }
+        TRACE_MARK("receive");
+        buf[MSGSIZE - 1] = 0;
+
+        if (strncmp(buf, "status ", strlen("status ")) == 0 && STATUS == msg_prio)
+        {
+            int pid = strtol(buf + strlen("status "), NULL, 10);
+            // the send time, which is not printed
+            uint64_t sent = 0;
+            char *stamp = strstr(buf, " @");
+            if (stamp)
             {
-            case -1:
-                ERR("fork()");
-            case 0:
-                child_work(pid, t);
-                exit(EXIT_SUCCESS);
+                sent = strtoull(stamp + 2, NULL, 16);
+                *stamp = 0;
             }
+            enqueue(shard, find_client(shard, pid), buf, sent);
         }
+        else if (strncmp(buf, "register ", strlen("register ")) == 0 && REGISTER == msg_prio)
+        {
+            print_line(buf);
+            register_message(shard, buf);
+        }
+        else if (strncmp(buf, "unregister ", strlen("unregister ")) == 0 && REGISTER == msg_prio)
+        {
+            print_line(buf);
+            unregister_message(shard, buf);
+        }
+    }
+}
+
+void *dispatcher(void *arg)
+{
+    struct shard *shard = arg;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(shard->index % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+    // pinning is only a hint, a restricted cpuset may refuse it
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+    while (last_signal != SIGINT)
+    {
+        drain(shard);
+        forget_gone(shard);
+        serve_round(shard);
+        if (shard->stats_seen != stats_requests)
+        {
+            shard->stats_seen = stats_requests;
+            print_stats(shard);
+        }
+    }
+    return NULL;
+}
+
+long system_msg_max(void)
+{
+    long msg_max = 10;
+    FILE *file = fopen("/proc/sys/fs/mqueue/msg_max", "r");
+    if (file)
+    {
+        if (fscanf(file, "%ld", &msg_max) != 1)
+            msg_max = 10;
+        fclose(file);
     }
+    return msg_max;
+}
 
+// Shard queues get as many messages as the system lets them have, so a
+// burst of clients fills the queue before their sends block. Only a
+// privileged process may go above msg_max, and every process stops at
+// RLIMIT_MSGQUEUE bytes over all its queues.
+mqd_t open_shard(struct shard *shard)
+{
+    struct mq_attr attr;
+    attr.mq_maxmsg = SHARD_MAXMSG;
+    attr.mq_msgsize = MSGSIZE;
+    mqd_t mqdes;
+    while (-1 == (mqdes = mq_open(shard->name, O_RDONLY | O_CREAT | O_EXCL, 0600, &attr)))
+    {
+        if (EINVAL == errno && attr.mq_maxmsg > system_msg_max())
+            attr.mq_maxmsg = system_msg_max();
+        else if (EMFILE == errno && attr.mq_maxmsg > 1)
+            attr.mq_maxmsg /= 2;
+        else
+            ERR("mq_open");
+    }
+    return mqdes;
+}
+
+void raise_queue_limit(void)
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_MSGQUEUE, &rl))
+        ERR("getrlimit");
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_MSGQUEUE, &rl))
+        ERR("setrlimit");
+}
+
+void parent_work(struct shard *shards, int k)
+{
+    // only the main thread takes SIGINT and SIGUSR1, the dispatchers poll
+    // the flags
+    sigset_t mask, old;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, &old);
+    for (int i = 0; i < k; ++i)
+        if (pthread_create(&shards[i].thread, NULL, dispatcher, &shards[i]))
+            ERR("pthread_create");
+    for (int i = 0; i < downstream_count; ++i)
+        if (pthread_create(&downstreams[i].thread, NULL, broadcaster, &downstreams[i]))
+            ERR("pthread_create");
+    sigdelset(&old, SIGINT);
+    sigdelset(&old, SIGUSR1);
+    while (last_signal != SIGINT)
+        sigsuspend(&old);
+    for (int i = 0; i < k; ++i)
+        if (pthread_join(shards[i].thread, NULL))
+            ERR("pthread_join");
+    for (int i = 0; i < downstream_count; ++i)
+        if (pthread_join(downstreams[i].thread, NULL))
+            ERR("pthread_join");
+
+    // the spawner stops its children once the pipe is closed
+    if (spawner_fd >= 0 && close(spawner_fd))
+        ERR("close");
     while (wait(NULL) > 0)
         ;
 }
 
 int main(int argc, char **argv)
 {
+    err_kill_group = 1;
     set_handler(sig_handler, SIGINT);
+    set_handler(sig_handler, SIGUSR1);
 
-    if (argc != 3)
+    int k = sysconf(_SC_NPROCESSORS_ONLN);
+    int c;
+    while ((c = getopt(argc, argv, "k:m:")) != -1)
+        switch (c)
+        {
+        case 'k':
+            k = strtol(optarg, NULL, 10);
+            break;
+        case 'm':
+            downstream_count = strtol(optarg, NULL, 10);
+            if (downstream_count < 1 || downstream_count > MAX_CHANNELS)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    if (argc - optind != 2)
+        usage(argv[0]);
+    if (k > MAX_SHARDS)
+        k = MAX_SHARDS;
+    if (k < 1)
         usage(argv[0]);
 
-    int t = strtol(argv[2], NULL, 10);
+    int t = strtol(argv[optind + 1], NULL, 10);
     if (t < 100 || t > 2000)
         usage(argv[0]);
 
-    struct mq_attr attr;
-    attr.mq_maxmsg = 10;
-    attr.mq_msgsize = MSGSIZE;
-
-    mqd_t mqdes = mq_open(argv[1], O_RDONLY | O_CREAT | O_EXCL | O_NONBLOCK, 0600, &attr);
-    if (-1 == mqdes)
-        ERR("mq_open");
+    for (int i = 0; i < REGISTRY_STRIPES; ++i)
+        if (pthread_mutex_init(&registry[i].mutex, NULL))
+            ERR("pthread_mutex_init");
+    raise_queue_limit();
+    shard_count = k;
+    if (!(shards = calloc(k, sizeof(*shards))))
+        ERR("calloc");
+    for (int i = 0; i < k; ++i)
+    {
+        shards[i].index = i;
+        shards[i].t = t;
+        if (pthread_mutex_init(&shards[i].gone_mutex, NULL))
+            ERR("pthread_mutex_init");
+        shard_name(shards[i].name, sizeof(shards[i].name), argv[optind], i);
+        shards[i].mqdes = open_shard(&shards[i]);
+    }
+    if (downstream_count && !(downstreams = calloc(downstream_count, sizeof(*downstreams))))
+        ERR("calloc");
+    for (int i = 0; i < downstream_count; ++i)
+    {
+        downstreams[i].t = t;
+        channel_name(downstreams[i].name, sizeof(downstreams[i].name), argv[optind], i);
+        open_channel(&downstreams[i], downstream_count);
+    }
 
-    parent_work(mqdes, t);
+    if (!downstream_count)
+        start_spawner(t);
+    parent_work(shards, k);
 
-    mq_close(mqdes);
-    if (mq_unlink(argv[1]))
-        ERR("mq_unlink");
+    for (int i = 0; i < k; ++i)
+    {
+        mq_close(shards[i].mqdes);
+        if (mq_unlink(shards[i].name))
+            ERR("mq_unlink");
+        for (int j = 0; j < shards[i].count; ++j)
+            free(shards[i].clients[j]);
+        free(shards[i].clients);
+        free(shards[i].table);
+        pthread_mutex_destroy(&shards[i].gone_mutex);
+        free(shards[i].gone);
+    }
+    for (int i = 0; i < downstream_count; ++i)
+    {
+        munmap(downstreams[i].ch, sizeof(*downstreams[i].ch));
+        if (shm_unlink(downstreams[i].name))
+            ERR("shm_unlink");
+        pthread_mutex_destroy(&downstreams[i].mutex);
+        free(downstreams[i].subscribers);
+    }
+    free(downstreams);
+    for (int i = 0; i < REGISTRY_STRIPES; ++i)
+    {
+        pthread_mutex_destroy(&registry[i].mutex);
+        free(registry[i].pids);
+    }
+    free(shards);
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
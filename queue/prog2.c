@@ -1,40 +1,34 @@
 #define _GNU_SOURCE
 #include <errno.h>
+#include <limits.h>
 #include <mqueue.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "channel.h"
+#include "shard.h"
+#include "util.h"
+
 #define MSGSIZE 50
 #define REGISTER 0
 #define STATUS 1
 
-#define ERR(source) (perror(source),                                 \
-                     fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
-                     exit(EXIT_FAILURE))
-
 volatile sig_atomic_t last_signal = 0;
 
 void usage(char *name)
 {
-    fprintf(stderr, "USAGE: %s q0_name t\n", name);
+    fprintf(stderr, "USAGE: %s q0_name t [weight]\n", name);
     fprintf(stderr, "USAGE: q0_name matches \"/[A-Za-z0-9._-]+\"\n");
     fprintf(stderr, "USAGE: t belongs to [100, 2000]\n");
+    fprintf(stderr, "USAGE: weight belongs to [1, 100], the share of the server, 1 by default\n");
     exit(EXIT_FAILURE);
 }
 
-void set_handler(void (*f)(int), int sig)
-{
-    struct sigaction act;
-    memset(&act, 0, sizeof(act));
-    act.sa_handler = f;
-    if (sigaction(sig, &act, NULL) < 0)
-        ERR("sigaction()");
-}
-
 void sig_handler(int sig)
 {
     last_signal = sig;
@@ -59,7 +53,32 @@ void set_timeout(struct timespec *st, int t)
     }
 }
 
-void process_messages(mqd_t mqdes1, mqd_t mqdes2, int t)
+// Where the "check status" messages come from: a queue of our own, or the
+// downstream channel the server multiplexes us onto.
+struct downstream
+{
+    mqd_t mqdes;
+    struct channel *ch;
+    uint64_t cursor;
+};
+
+int receive_downstream(struct downstream *d, char *buf, int t)
+{
+    struct timespec st;
+    set_timeout(&st, t);
+    if (!d->ch)
+        return mq_timedreceive(d->mqdes, buf, MSGSIZE, NULL, &st);
+    for (;;)
+    {
+        uint32_t seen = atomic_load_explicit(&d->ch->futex, memory_order_acquire);
+        if (channel_read(d->ch, &d->cursor, getpid(), buf))
+            return 0;
+        if (channel_wait(d->ch, seen, &st) == -1 && EAGAIN != errno)
+            return -1;
+    }
+}
+
+void process_messages(mqd_t mqdes1, struct downstream *d, int t)
 {
     int pid = getpid();
     srand(pid);
@@ -69,10 +88,7 @@ void process_messages(mqd_t mqdes1, mqd_t mqdes2, int t)
         int value = rand() % 2;
 
         char buf[MSGSIZE];
-        struct timespec st;
-        set_timeout(&st, t);
-
-        if (mq_timedreceive(mqdes2, buf, sizeof(buf), NULL, &st) == -1)
+        if (receive_downstream(d, buf, t) == -1)
         {
             if (ETIMEDOUT == errno)
                 continue;
@@ -84,24 +100,92 @@ void process_messages(mqd_t mqdes1, mqd_t mqdes2, int t)
         printf("%s\n", buf);
         fflush(stdout);
 
-        snprintf(buf, sizeof(buf), "status %d %d [%d]", pid, value, i);
+        // stamped with the send time, so prog1 counts the wait in the queue too
+        snprintf(buf, sizeof(buf), "status %d %d [%d] @%llx", pid, value, i, (unsigned long long)now_ns());
         TEMP_FAILURE_RETRY(mq_send(mqdes1, buf, sizeof(buf), STATUS));
     }
 }
 
+struct channel *map_channel(const char *name)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        if (ENOENT == errno)
+            return NULL;
+        ERR("shm_open");
+    }
+    struct channel *ch = mmap(NULL, sizeof(*ch), PROT_READ, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == ch)
+        ERR("mmap");
+    if (close(fd))
+        ERR("close");
+    if (ch->magic != CHANNEL_MAGIC)
+        exit(EXIT_FAILURE);
+    return ch;
+}
+
+// Maps the downstream channel of pid; returns 0 if the server keeps a
+// queue per client.
+int open_channel(struct downstream *d, const char *q0_name, pid_t pid)
+{
+    char name[NAME_MAX + 1];
+    channel_name(name, sizeof(name), q0_name, 0);
+    struct channel *first = map_channel(name);
+    if (!first)
+        return 0;
+    int channel = shard_of(pid, first->channels);
+    munmap(first, sizeof(*first));
+    channel_name(name, sizeof(name), q0_name, channel);
+    if (!(d->ch = map_channel(name)))
+        ERR("shm_open");
+    d->cursor = atomic_load_explicit(&d->ch->head, memory_order_acquire);
+    return 1;
+}
+
+// Counts the shard queues of the server; 0 if it serves q0_name alone.
+int count_shards(const char *q0_name)
+{
+    char name[NAME_MAX + 1];
+    int k = 0;
+    for (; k < MAX_SHARDS; ++k)
+    {
+        shard_name(name, sizeof(name), q0_name, k);
+        mqd_t mqdes = mq_open(name, O_WRONLY);
+        if (-1 == mqdes)
+        {
+            if (ENOENT == errno)
+                break;
+            ERR("mq_open");
+        }
+        mq_close(mqdes);
+    }
+    return k;
+}
+
 int main(int argc, char **argv)
 {
     set_handler(sig_handler, SIGINT);
 
-    if (argc != 3)
+    if (argc != 3 && argc != 4)
         usage(argv[0]);
 
     int t = strtol(argv[2], NULL, 10);
     if (t < 100 || t > 2000)
         usage(argv[0]);
+    int weight = 4 == argc ? strtol(argv[3], NULL, 10) : 1;
+    if (weight < 1 || weight > 100)
+        usage(argv[0]);
 
     sleep(1);
-    mqd_t mqdes1 = mq_open(argv[1], O_WRONLY);
+    int pid = getpid();
+    char name[NAME_MAX + 1];
+    int k = count_shards(argv[1]);
+    if (k)
+        shard_name(name, sizeof(name), argv[1], shard_of(pid, k));
+    else
+        snprintf(name, sizeof(name), "%s", argv[1]);
+    mqd_t mqdes1 = mq_open(name, O_WRONLY);
     if (-1 == mqdes1)
         ERR("mq_open");
 
@@ -111,27 +195,34 @@ int main(int argc, char **argv)
     if (attr.mq_msgsize != MSGSIZE)
         exit(EXIT_FAILURE);
 
-    int pid = getpid();
     char buf[MSGSIZE];
-    snprintf(buf, sizeof(buf), "register %d", pid);
+    snprintf(buf, sizeof(buf), "register %d %d", pid, weight);
     TEMP_FAILURE_RETRY(mq_send(mqdes1, buf, sizeof(buf), REGISTER));
 
-    char name[MSGSIZE];
-    snprintf(name, sizeof(name), "/q%d", pid);
-
     sleep(1);
-    mqd_t mqdes2 = mq_open(name, O_RDONLY);
-    if (-1 == mqdes2)
-        ERR("mq_open");
-
-    if (mq_getattr(mqdes2, &attr))
-        ERR("mq_getattr");
-    if (attr.mq_msgsize != MSGSIZE)
-        exit(EXIT_FAILURE);
+    struct downstream d = {.mqdes = -1, .ch = NULL, .cursor = 0};
+    if (!open_channel(&d, argv[1], pid))
+    {
+        snprintf(name, sizeof(name), "/q%d", pid);
+        d.mqdes = mq_open(name, O_RDONLY);
+        if (-1 == d.mqdes)
+            ERR("mq_open");
+
+        if (mq_getattr(d.mqdes, &attr))
+            ERR("mq_getattr");
+        if (attr.mq_msgsize != MSGSIZE)
+            exit(EXIT_FAILURE);
+    }
 
-    process_messages(mqdes1, mqdes2, t);
+    process_messages(mqdes1, &d, t);
 
+    // lets prog1 drop us from its registry and downstream channel
+    snprintf(buf, sizeof(buf), "unregister %d", pid);
+    TEMP_FAILURE_RETRY(mq_send(mqdes1, buf, sizeof(buf), REGISTER));
     mq_close(mqdes1);
-    mq_close(mqdes2);
+    if (d.ch)
+        munmap(d.ch, sizeof(*d.ch));
+    else
+        mq_close(d.mqdes);
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,24 @@
+#ifndef QUEUE_SHARD_H
+#define QUEUE_SHARD_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+// prog1 serves its clients on the queues <q0_name>.0 ... <q0_name>.K-1,
+// and a client sends everything to the shard its pid hashes to.
+
+#define MAX_SHARDS 64
+
+static inline void shard_name(char *buf, size_t size, const char *q0_name, int shard)
+{
+    snprintf(buf, size, "%s.%d", q0_name, shard);
+}
+
+static inline int shard_of(pid_t pid, int shards)
+{
+    // Fibonacci hashing spreads consecutive pids over the shards
+    return ((uint32_t)pid * 2654435769u >> 16) % shards;
+}
+
+#endif
@@ -1,71 +1,563 @@
 #define _GNU_SOURCE
 
+#include <arpa/inet.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
-#define ERR(source) (perror(source),                                 \
-                     fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
-                     exit(EXIT_FAILURE))
+#include "buffer.h"
+#include "reactor.h"
+#include "trace.h"
+#include "util.h"
 
 #define MAX_CLIENTS 3
 #define MAX_RULES 10
 #define MAX_SIZE 100
+#define MAX_DATAGRAM 65536
+#define SNAPSHOT_MAGIC 0x55445046  // "UDPF"
+#define SNAPSHOT_VERSION 2  // version 1 had no limits
+#define CAPTURE_RING (4 << 20)
+#define CAPTURE_ROTATE (64 << 20)  // bytes of a pcap file before it is rotated
+#define CAPTURE_FILES 4            // kept as file.1 ... file.3 besides file
+#define CAPTURE_IDLE_MS 10
 
+// A token bucket refilled on demand from the clock; a rate of 0 means no
+// limit. It holds a second's worth of tokens and a datagram passes while
+// any are left, so a byte rate below the datagram size still lets some
+// traffic through and the debt is paid back later.
+struct bucket
+{
+    uint32_t rate;  // per second
+    double tokens;
+    uint64_t last;
+};
+
+struct limit
+{
+    struct bucket packets, bytes;
+};
+
+struct destination
+{
+    struct sockaddr_in addr;
+    struct limit limit;
+    uint64_t sent, bytes, dropped;
+};
+
+// A forwarding rule: datagrams coming to the socket go to every address.
+// The limit of the rule applies before the fan-out, the limit of each
+// destination to what is sent there.
 struct udp_table
 {
-    int udp_socket;
-    struct sockaddr_in *addr;
+    source source;  // fd is -1 when the rule is not used
+    struct destination *dest;
     int size;
+    struct limit limit;
+    uint64_t received, dropped;
+    // capture: one datagram in sample is copied, up to snaplen bytes
+    bool capturing;
+    uint32_t snaplen, sample, countdown;
+    uint64_t captured, capture_dropped;
+};
+
+enum capture_type
+{
+    CAPTURE_PAD,  // fills the end of the ring, the next record is at its start
+    CAPTURE_OPEN,
+    CAPTURE_PACKET,
+    CAPTURE_CLOSE,
+};
+
+// A record in the capture ring. A packet record is followed by caplen
+// bytes of the datagram and then by the destinations it was sent to; an
+// open record by the path of the file, which is already open as fd.
+struct capture_record
+{
+    uint32_t size;  // of the whole record, a multiple of 8
+    uint16_t type;
+    uint16_t rule;
+    uint64_t time;  // CLOCK_REALTIME in nanoseconds
+    uint32_t caplen, origlen;
+    uint32_t src_addr;  // the sender, in network byte order
+    uint16_t src_port;
+    uint16_t dst_port;  // the port of the rule in an open record
+    uint32_t ndest;  // or the fd of an open record
+};
+
+struct capture_destination
+{
+    uint32_t addr;
+    uint16_t port;
+} __attribute__((packed));
+
+// Where the writer thread puts the packets of a rule.
+struct capture_file
+{
+    FILE *file;
+    char path[PATH_MAX];
+    uint32_t snaplen;
+    uint16_t port;  // of the rule, in network byte order
+    size_t written;
+};
+
+// Single-producer, single-consumer ring: the forwarding loop appends
+// records at head and the writer thread consumes them at tail, each
+// touching only its own index. The forwarding loop never waits for the
+// writer; a record that does not fit is dropped.
+struct capture_ring
+{
+    char *data;
+    uint64_t reserved;  // head after the pad of the record being built
+    _Atomic uint64_t head;
+    char pad[CACHE_LINE];
+    _Atomic uint64_t tail;
+    atomic_bool stop;
+    bool running;
+    pthread_t thread;
+    struct capture_file files[MAX_RULES];
+};
+
+// A control connection, read line by line.
+struct client
+{
+    source source;  // fd is -1 when the slot is free
+    reader reader;
+};
+
+struct server
+{
+    reactor reactor;
+    source listener;
+    struct client tcp_clients[MAX_CLIENTS];
+    struct udp_table udp_rules[MAX_RULES];
+    const char *snapshot;  // the rules are saved here after every change
+    const char *upgrade;   // a new binary takes the sockets over here
+    source successor;      // listens on upgrade
+    bool handed_over;
+    struct capture_ring capture;
+    char datagram[MAX_DATAGRAM];
+};
+
+// The rule table, as saved in a snapshot and passed on to a new binary.
+// All fields are in network byte order; the rules follow the header.
+struct snapshot_header
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t rules;
+};
+
+struct snapshot_rule
+{
+    uint16_t port;
+    uint16_t size;  // followed by as many destinations
 };
 
-volatile sig_atomic_t do_work = 1;
+struct snapshot_destination
+{
+    uint32_t addr;
+    uint16_t port;
+} __attribute__((packed));
+
+// Follows every rule and destination since version 2.
+struct snapshot_limit
+{
+    uint32_t pps;
+    uint32_t bps;
+};
+
+void bucket_set(struct bucket *b, uint32_t rate, uint64_t now)
+{
+    b->rate = rate;
+    b->tokens = rate;
+    b->last = now;
+}
+
+void bucket_refill(struct bucket *b, uint64_t now)
+{
+    if (!b->rate)
+        return;
+    b->tokens += (now - b->last) * 1e-9 * b->rate;
+    if (b->tokens > b->rate)
+        b->tokens = b->rate;
+    b->last = now;
+}
+
+void limit_set(struct limit *l, uint32_t pps, uint32_t bps, uint64_t now)
+{
+    bucket_set(&l->packets, pps, now);
+    bucket_set(&l->bytes, bps, now);
+}
+
+// Takes a datagram of size bytes out of both buckets, or neither.
+bool limit_pass(struct limit *l, size_t size, uint64_t now)
+{
+    bucket_refill(&l->packets, now);
+    bucket_refill(&l->bytes, now);
+    if ((l->packets.rate && l->packets.tokens <= 0) || (l->bytes.rate && l->bytes.tokens <= 0))
+        return false;
+    l->packets.tokens -= 1;
+    l->bytes.tokens -= size;
+    return true;
+}
+
+void clear_destinations(struct udp_table *rule)
+{
+    free(rule->dest);
+    rule->dest = NULL;
+    rule->size = 0;
+}
+
+void free_rule(struct udp_table *rule)
+{
+    if (TEMP_FAILURE_RETRY(close(rule->source.fd)))
+        ERR("close");
+    rule->source.fd = -1;
+    clear_destinations(rule);
+    memset(&rule->limit, 0, sizeof rule->limit);
+    rule->received = rule->dropped = 0;
+}
+
+// The port of the rule, in network byte order.
+uint16_t rule_port(struct udp_table *rule)
+{
+    struct sockaddr_in addr;
+    socklen_t size = sizeof addr;
+    if (getsockname(rule->source.fd, &addr, &size))
+        ERR("getsockname()");
+    return addr.sin_port;
+}
+
+struct destination *add_destination(struct udp_table *rule, struct sockaddr_in addr)
+{
+    rule->dest = realloc(rule->dest, (rule->size + 1) * sizeof *rule->dest);
+    if (!rule->dest)
+        ERR("realloc");
+    struct destination *dest = &rule->dest[rule->size++];
+    memset(dest, 0, sizeof *dest);
+    dest->addr = addr;
+    return dest;
+}
 
-void my_close(uint16_t port, struct udp_table *udp_rules)
+struct udp_table *find_rule(uint16_t port, struct udp_table *udp_rules)
 {
     port = htons(port);
     for (int i = 0; i < MAX_RULES; ++i)
+        if (udp_rules[i].source.fd != -1 && rule_port(&udp_rules[i]) == port)
+            return &udp_rules[i];
+    return NULL;
+}
+
+uint32_t align8(uint64_t size)
+{
+    return (size + 7) & ~(uint64_t)7;
+}
+
+// Returns room for a record of size bytes, or NULL if the ring is full.
+struct capture_record *ring_reserve(struct capture_ring *ring, uint32_t size)
+{
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    uint64_t offset = head & (CAPTURE_RING - 1);
+    uint64_t pad = offset + size > CAPTURE_RING ? CAPTURE_RING - offset : 0;
+    if (size > CAPTURE_RING / 4 || head + pad + size - tail > CAPTURE_RING)
+        return NULL;
+    if (pad)
     {
-        if (-1 == udp_rules[i].udp_socket)
-            continue;
-        struct sockaddr_in addr;
-        socklen_t size = sizeof addr;
-        if (getsockname(udp_rules[i].udp_socket, &addr, &size))
-            ERR("getsockname()");
-        if (addr.sin_port == port)
+        struct capture_record *record = (struct capture_record *)(ring->data + offset);
+        record->size = pad;
+        record->type = CAPTURE_PAD;
+    }
+    ring->reserved = head + pad;
+    return (struct capture_record *)(ring->data + (ring->reserved & (CAPTURE_RING - 1)));
+}
+
+void ring_commit(struct capture_ring *ring, struct capture_record *record)
+{
+    atomic_store_explicit(&ring->head, ring->reserved + record->size, memory_order_release);
+}
+
+// Starts a record of a datagram the rule received if it is sampled. The
+// destinations are added while it is being forwarded.
+struct capture_record *capture_begin(struct server *server, struct udp_table *rule, const struct sockaddr_in *src,
+                                     const char *buf, uint32_t count)
+{
+    if (!rule->capturing || --rule->countdown)
+        return NULL;
+    rule->countdown = rule->sample;
+    uint32_t caplen = count < rule->snaplen ? count : rule->snaplen;
+    struct capture_record *record = ring_reserve(
+        &server->capture,
+        align8(sizeof *record + caplen + (uint64_t)rule->size * sizeof(struct capture_destination)));
+    if (!record)
+    {
+        ++rule->capture_dropped;
+        return NULL;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    record->size = align8(sizeof *record + caplen + (uint64_t)rule->size * sizeof(struct capture_destination));
+    record->type = CAPTURE_PACKET;
+    record->rule = rule - server->udp_rules;
+    record->time = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    record->caplen = caplen;
+    record->origlen = count;
+    record->src_addr = src->sin_addr.s_addr;
+    record->src_port = src->sin_port;
+    record->dst_port = 0;
+    record->ndest = 0;
+    memcpy(record + 1, buf, caplen);
+    return record;
+}
+
+void capture_sent(struct capture_record *record, const struct destination *dest)
+{
+    struct capture_destination *d =
+        (struct capture_destination *)((char *)(record + 1) + record->caplen) + record->ndest++;
+    d->addr = dest->addr.sin_addr.s_addr;
+    d->port = dest->addr.sin_port;
+}
+
+void capture_end(struct server *server, struct udp_table *rule, struct capture_record *record)
+{
+    ring_commit(&server->capture, record);
+    ++rule->captured;
+}
+
+// Tells the writer to close the file of the rule. Returns false if the
+// ring is full; a later open for the rule closes the file then.
+bool capture_stop(struct capture_ring *ring, int index, struct udp_table *rule)
+{
+    if (!rule->capturing)
+        return true;
+    rule->capturing = false;
+    struct capture_record *record = ring_reserve(ring, sizeof *record);
+    if (!record)
+        return false;
+    record->size = sizeof *record;
+    record->type = CAPTURE_CLOSE;
+    record->rule = index;
+    ring_commit(ring, record);
+    return true;
+}
+
+struct pcap_file_header
+{
+    uint32_t magic;
+    uint16_t major, minor;
+    int32_t zone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+// A pcap packet with the IPv4 and UDP headers synthesized for it.
+struct pcap_packet
+{
+    uint32_t sec, nsec;
+    uint32_t caplen, len;
+    struct iphdr ip;
+    struct udphdr udp;
+} __attribute__((packed));
+
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define LINKTYPE_IPV4 228
+
+uint16_t ip_checksum(const void *data, size_t len)
+{
+    const uint16_t *words = data;
+    uint32_t sum = 0;
+    for (size_t i = 0; i < len / 2; ++i)
+        sum += words[i];
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+void capture_failed(struct capture_file *f)
+{
+    perror(f->path);
+    fclose(f->file);
+    f->file = NULL;
+}
+
+void pcap_start(struct capture_file *f)
+{
+    struct pcap_file_header header = {PCAP_MAGIC_NS, 2, 4, 0, 0, f->snaplen + sizeof(struct iphdr) + sizeof(struct udphdr),
+                                      LINKTYPE_IPV4};
+    if (fwrite(&header, sizeof header, 1, f->file) != 1)
+        return capture_failed(f);
+    f->written = sizeof header;
+}
+
+void pcap_write(struct capture_file *f, const struct capture_record *record, uint32_t src_addr, uint16_t src_port,
+                uint32_t dst_addr, uint16_t dst_port)
+{
+    struct pcap_packet packet;
+    memset(&packet, 0, sizeof packet);
+    packet.sec = record->time / 1000000000;
+    packet.nsec = record->time % 1000000000;
+    packet.caplen = sizeof packet.ip + sizeof packet.udp + record->caplen;
+    packet.len = sizeof packet.ip + sizeof packet.udp + record->origlen;
+    packet.ip.version = 4;
+    packet.ip.ihl = sizeof packet.ip / 4;
+    packet.ip.tot_len = htons(packet.len);
+    packet.ip.ttl = 64;
+    packet.ip.protocol = IPPROTO_UDP;
+    packet.ip.saddr = src_addr;
+    packet.ip.daddr = dst_addr;
+    packet.ip.check = ip_checksum(&packet.ip, sizeof packet.ip);
+    packet.udp.source = src_port;
+    packet.udp.dest = dst_port;
+    packet.udp.len = htons(sizeof packet.udp + record->origlen);
+    // a zero UDP checksum means none over IPv4
+    if (fwrite(&packet, sizeof packet, 1, f->file) != 1 || fwrite(record + 1, record->caplen, 1, f->file) != 1)
+        return capture_failed(f);
+    f->written += sizeof packet + record->caplen;
+}
+
+// Moves file to file.1, file.1 to file.2 and so on, and starts file anew.
+void capture_rotate(struct capture_file *f)
+{
+    char from[PATH_MAX + 16], to[PATH_MAX + 16];
+    if (fclose(f->file))
+        perror(f->path);
+    f->file = NULL;
+    for (int i = CAPTURE_FILES - 1; i > 0; --i)
+    {
+        if (i > 1)
+            snprintf(from, sizeof from, "%s.%d", f->path, i - 1);
+        else
+            snprintf(from, sizeof from, "%s", f->path);
+        snprintf(to, sizeof to, "%s.%d", f->path, i);
+        if (rename(from, to) && errno != ENOENT)
+            perror(from);
+    }
+    if (!(f->file = fopen(f->path, "we")))
+        return perror(f->path);
+    pcap_start(f);
+}
+
+void capture_handle(struct capture_ring *ring, const struct capture_record *record)
+{
+    struct capture_file *f = &ring->files[record->rule];
+    switch (record->type)
+    {
+    case CAPTURE_OPEN:
+        if (f->file && fclose(f->file))
+            perror(f->path);
+        snprintf(f->path, sizeof f->path, "%s", (const char *)(record + 1));
+        f->snaplen = record->caplen;
+        f->port = record->dst_port;
+        if (!(f->file = fdopen(record->ndest, "w")))
         {
-            if (TEMP_FAILURE_RETRY(close(udp_rules[i].udp_socket)))
-                ERR("close");
-            udp_rules[i].udp_socket = -1;
-            free(udp_rules[i].addr);
-            udp_rules[i].addr = NULL;
-            udp_rules[i].size = 0;
+            perror(f->path);
+            TEMP_FAILURE_RETRY(close(record->ndest));
             return;
         }
+        pcap_start(f);
+        return;
+    case CAPTURE_PACKET:
+        if (!f->file)
+            return;
+        // the rule listens on the loopback address, on the port it was received at
+        pcap_write(f, record, record->src_addr, record->src_port, htonl(INADDR_LOOPBACK), f->port);
+        const struct capture_destination *dest =
+            (const struct capture_destination *)((const char *)(record + 1) + record->caplen);
+        for (uint32_t i = 0; i < record->ndest && f->file; ++i)
+            pcap_write(f, record, htonl(INADDR_LOOPBACK), f->port, dest[i].addr, dest[i].port);
+        if (f->file && f->written >= CAPTURE_ROTATE)
+            capture_rotate(f);
+        return;
+    case CAPTURE_CLOSE:
+        if (f->file && fclose(f->file))
+            perror(f->path);
+        f->file = NULL;
+        return;
     }
 }
 
-struct sockaddr_in make_address(char *address, char *port)
+// Drains the ring into the pcap files, and sleeps while it is empty.
+void *capture_writer(void *arg)
 {
-    struct addrinfo hints = {};
-    hints.ai_family = AF_INET;
-    struct addrinfo *result;
-    int ret = getaddrinfo(address, port, &hints, &result);
-    if (ret)
+    struct capture_ring *ring = arg;
+    struct timespec idle = {0, CAPTURE_IDLE_MS * 1000000};
+    for (;;)
     {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
-        exit(EXIT_FAILURE);
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (tail == head)
+        {
+            if (atomic_load(&ring->stop))
+                break;
+            for (int i = 0; i < MAX_RULES; ++i)
+                if (ring->files[i].file && fflush(ring->files[i].file))
+                    capture_failed(&ring->files[i]);
+            nanosleep(&idle, NULL);
+            continue;
+        }
+        for (; tail != head; atomic_store_explicit(&ring->tail, tail, memory_order_release))
+        {
+            const struct capture_record *record =
+                (const struct capture_record *)(ring->data + (tail & (CAPTURE_RING - 1)));
+            capture_handle(ring, record);
+            tail += record->size;
+        }
+    }
+    for (int i = 0; i < MAX_RULES; ++i)
+        if (ring->files[i].file && fclose(ring->files[i].file))
+            perror(ring->files[i].path);
+    return NULL;
+}
+
+void capture_start(struct capture_ring *ring)
+{
+    if (ring->running)
+        return;
+    ring->data = mmap(NULL, CAPTURE_RING, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == ring->data)
+        ERR("mmap");
+    if (pthread_create(&ring->thread, NULL, capture_writer, ring))
+        ERR("pthread_create");
+    ring->running = true;
+}
+
+void capture_shutdown(struct capture_ring *ring)
+{
+    if (!ring->running)
+        return;
+    atomic_store(&ring->stop, true);
+    if (pthread_join(ring->thread, NULL))
+        ERR("pthread_join");
+    if (munmap(ring->data, CAPTURE_RING))
+        ERR("munmap");
+    ring->running = false;
+}
+
+void my_close(uint16_t port, struct udp_table *udp_rules, struct capture_ring *ring)
+{
+    struct udp_table *rule = find_rule(port, udp_rules);
+    if (rule)
+    {
+        capture_stop(ring, rule - udp_rules, rule);
+        free_rule(rule);
     }
-    struct sockaddr_in addr = *(struct sockaddr_in *)(result->ai_addr);
-    freeaddrinfo(result);
-    return addr;
 }
 
 char *trim_whitespace(char *str)
@@ -82,58 +574,74 @@ char *trim_whitespace(char *str)
     return str;
 }
 
-int make_socket(int domain, int type)
+void forward_datagram(reactor *r, source *s, uint32_t events)
 {
-    int socketfd = socket(domain, type, 0);
-    if (socketfd < 0)
-        ERR("socket");
-    return socketfd;
-}
-
-int bind_inet_socket(uint16_t port, int type)
-{
-    int socketfd = make_socket(PF_INET, type);
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof addr);
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-    int t = 1;
-    if (setsockopt(socketfd, SOL_SOCKET, SO_REUSEADDR, &t, sizeof t))
-        ERR("setsockopt");
-    if (bind(socketfd, (struct sockaddr *)&addr, sizeof addr))
-        ERR("bind");
-    if (SOCK_STREAM == type)
-        if (listen(socketfd, MAX_CLIENTS))
-            ERR("listen");
-    return socketfd;
+    struct server *server = container_of(r, struct server, reactor);
+    struct udp_table *rule = container_of(s, struct udp_table, source);
+    if (s->fd < 0)
+        // closed earlier in the same batch of events
+        return;
+    char *buf = server->datagram;
+    struct sockaddr_in src;
+    socklen_t size = sizeof src;
+    int count = TEMP_FAILURE_RETRY(recvfrom(s->fd, buf, MAX_DATAGRAM, 0, (struct sockaddr *)&src, &size));
+    if (count < 0)
+    {
+        if (EAGAIN == errno)
+            return;
+        ERR("recv");
+    }
+    ++rule->received;
+    // a flooded rule is cut off before its datagrams are multiplied
+    if (!limit_pass(&rule->limit, count, r->now))
+    {
+        ++rule->dropped;
+        return;
+    }
+    struct capture_record *record = capture_begin(server, rule, &src, buf, count);
+    TRACE_BEGIN("forward");
+    for (int j = 0; j < rule->size; ++j)
+    {
+        struct destination *dest = &rule->dest[j];
+        if (!limit_pass(&dest->limit, count, r->now))
+        {
+            ++dest->dropped;
+            continue;
+        }
+        if (TEMP_FAILURE_RETRY(sendto(s->fd, buf, count, 0, (struct sockaddr *)&dest->addr, sizeof dest->addr)) < 0)
+        {
+            if (errno != EAGAIN)
+                ERR("sendto");
+            ++dest->dropped;
+            continue;
+        }
+        ++dest->sent;
+        dest->bytes += count;
+        if (record)
+            capture_sent(record, dest);
+    }
+    TRACE_END("forward");
+    if (record)
+        capture_end(server, rule, record);
 }
 
-void fwd(uint16_t port, struct udp_table *udp_rules)
+void fwd(reactor *r, uint16_t port, struct udp_table *udp_rules)
 {
     bool exists = false;
     int j = -1;
     uint16_t lport = htons(port);
     for (int i = 0; i < MAX_RULES; ++i)
     {
-        struct udp_table udp_rule = udp_rules[i];
-        if (-1 == udp_rule.udp_socket)
+        if (-1 == udp_rules[i].source.fd)
         {
             if (-1 == j)
                 j = i;
         }
-        else
+        else if (rule_port(&udp_rules[i]) == lport)
         {
-            struct sockaddr_in addr;
-            socklen_t size = sizeof addr;
-            if (getsockname(udp_rule.udp_socket, &addr, &size))
-                ERR("getsockname()");
-            if (addr.sin_port == lport)
-            {
-                exists = true;
-                j = i;
-                break;
-            }
+            exists = true;
+            j = i;
+            break;
         }
     }
 
@@ -141,13 +649,10 @@ void fwd(uint16_t port, struct udp_table *udp_rules)
         return;
 
     if (exists)
-    {
-        free(udp_rules[j].addr);
-        udp_rules[j].addr = NULL;
-        udp_rules[j].size = 0;
-    }
+        clear_destinations(&udp_rules[j]);
     else
-        udp_rules[j].udp_socket = bind_inet_socket(port, SOCK_DGRAM);
+        reactor_add(r, &udp_rules[j].source, bind_inet_socket(port, SOCK_DGRAM | SOCK_NONBLOCK, 0), EPOLLIN,
+                    forward_datagram);
 
     for (;;)
     {
@@ -159,70 +664,305 @@ void fwd(uint16_t port, struct udp_table *udp_rules)
         if (!udp_port)
             break;
         udp_port = trim_whitespace(udp_port);
+        add_destination(&udp_rules[j], make_address(address, udp_port));
+    }
+}
+
+// limit <port> [<address>:<port>] <pps> <bps>, where 0 lifts a limit.
+void limit(reactor *r, uint16_t port, struct udp_table *udp_rules)
+{
+    struct udp_table *rule = find_rule(port, udp_rules);
+    char *arg = strtok(NULL, " ");
+    if (!rule || !arg)
+        return;
+    struct limit *l = &rule->limit;
+    char *colon = strchr(arg, ':');
+    if (colon)
+    {
+        *colon = 0;
+        struct sockaddr_in addr = make_address(arg, colon + 1);
+        l = NULL;
+        for (int j = 0; j < rule->size && !l; ++j)
+            if (rule->dest[j].addr.sin_addr.s_addr == addr.sin_addr.s_addr &&
+                rule->dest[j].addr.sin_port == addr.sin_port)
+                l = &rule->dest[j].limit;
+        if (!l || !(arg = strtok(NULL, " ")))
+            return;
+    }
+    char *bps = strtok(NULL, " ");
+    if (!bps)
+        return;
+    limit_set(l, strtoul(arg, NULL, 10), strtoul(bps, NULL, 10), r->now);
+}
+
+void reply(int fd, const char *text)
+{
+    if (bulk_write(fd, text, strlen(text)) < 0 && errno != EPIPE && errno != EAGAIN && errno != ECONNRESET)
+        ERR("write");
+}
+
+// capture <port> <file> [<snaplen> [<sample>]] copies one datagram in
+// sample, and where it was sent, into a pcap file; capture <port> off
+// stops. Errors are reported to the client.
+void capture(struct server *server, uint16_t port, int fd)
+{
+    char line[MAX_SIZE + PATH_MAX];
+    struct udp_table *rule = find_rule(port, server->udp_rules);
+    char *path = strtok(NULL, " ");
+    if (!rule || !path)
+    {
+        snprintf(line, sizeof line, "no rule %u\n", port);
+        return reply(fd, rule ? "capture <port> <file> [snaplen [sample]] | capture <port> off\n" : line);
+    }
+    int index = rule - server->udp_rules;
+    if (!strcmp(path, "off"))
+    {
+        if (!capture_stop(&server->capture, index, rule))
+            reply(fd, "capture ring full, the file is closed later\n");
+        return;
+    }
+    char *snaplen = strtok(NULL, " ");
+    char *sample = snaplen ? strtok(NULL, " ") : NULL;
+    int file = TEMP_FAILURE_RETRY(open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    if (file < 0)
+    {
+        snprintf(line, sizeof line, "capture %s: %s\n", path, strerror(errno));
+        return reply(fd, line);
+    }
+    capture_start(&server->capture);
+    // the open record replaces the file of a capture going on
+    rule->capturing = false;
+    struct capture_record *record = ring_reserve(&server->capture, align8(sizeof *record + strlen(path) + 1));
+    if (!record)
+    {
+        TEMP_FAILURE_RETRY(close(file));
+        return reply(fd, "capture ring full, try again\n");
+    }
+    record->size = align8(sizeof *record + strlen(path) + 1);
+    record->type = CAPTURE_OPEN;
+    record->rule = index;
+    record->caplen = snaplen ? strtoul(snaplen, NULL, 10) : MAX_DATAGRAM;
+    if (!record->caplen || record->caplen > MAX_DATAGRAM)
+        record->caplen = MAX_DATAGRAM;
+    record->dst_port = rule_port(rule);
+    record->ndest = file;
+    strcpy((char *)(record + 1), path);
+    ring_commit(&server->capture, record);
+    rule->capturing = true;
+    rule->snaplen = record->caplen;
+    rule->sample = sample && strtoul(sample, NULL, 10) > 0 ? strtoul(sample, NULL, 10) : 1;
+    rule->countdown = 1;
+    rule->captured = rule->capture_dropped = 0;
+}
 
-        if (!udp_rules[j].size)
+void append_limit(buffer *b, const struct limit *l)
+{
+    char line[MAX_SIZE];
+    snprintf(line, sizeof line, " limit %u pps %u B/s\n", l->packets.rate, l->bytes.rate);
+    buffer_append(b, line, strlen(line));
+}
+
+// Tells the client what a rule has forwarded and dropped so far.
+void stats(uint16_t port, struct udp_table *udp_rules, int fd)
+{
+    struct udp_table *rule = find_rule(port, udp_rules);
+    char line[MAX_SIZE];
+    buffer b = {0};
+    if (!rule)
+    {
+        snprintf(line, sizeof line, "no rule %u\n", port);
+        buffer_append(&b, line, strlen(line));
+    }
+    else
+    {
+        snprintf(line, sizeof line, "rule %u received %lu dropped %lu", port, rule->received, rule->dropped);
+        buffer_append(&b, line, strlen(line));
+        append_limit(&b, &rule->limit);
+        if (rule->capturing)
         {
-            udp_rules[j].addr = malloc(sizeof *udp_rules[j].addr);
-            if (!udp_rules[j].addr)
-                ERR("malloc");
+            snprintf(line, sizeof line, "  capture snaplen %u sample 1/%u captured %lu dropped %lu\n", rule->snaplen,
+                     rule->sample, rule->captured, rule->capture_dropped);
+            buffer_append(&b, line, strlen(line));
         }
-        else
+        for (int j = 0; j < rule->size; ++j)
         {
-            udp_rules[j].addr = realloc(udp_rules[j].addr, (udp_rules[j].size + 1) * sizeof *udp_rules[j].addr);
-            if (!udp_rules[j].addr)
-                ERR("realloc");
+            struct destination *dest = &rule->dest[j];
+            char address[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &dest->addr.sin_addr, address, sizeof address);
+            snprintf(line, sizeof line, "  %s:%u sent %lu bytes %lu dropped %lu", address,
+                     ntohs(dest->addr.sin_port), dest->sent, dest->bytes, dest->dropped);
+            buffer_append(&b, line, strlen(line));
+            append_limit(&b, &dest->limit);
         }
-        udp_rules[j].addr[udp_rules[j].size++] = make_address(address, udp_port);
     }
+    buffer_append(&b, "", 1);
+    reply(fd, b.data + b.start);
+    buffer_free(&b);
 }
 
-void parse(char *buf, struct udp_table *udp_rules)
+void save_limit(const struct limit *l, buffer *b)
 {
-    char *cmd = strtok(buf, " ");
-    if (!cmd)
-        return;
-    char *lport = strtok(NULL, " ");
-    if (!lport)
+    struct snapshot_limit entry = {htonl(l->packets.rate), htonl(l->bytes.rate)};
+    buffer_append(b, &entry, sizeof entry);
+}
+
+void save_rules(struct udp_table *udp_rules, buffer *b)
+{
+    struct snapshot_header header = {htonl(SNAPSHOT_MAGIC), htons(SNAPSHOT_VERSION), 0};
+    for (int i = 0; i < MAX_RULES; ++i)
+        header.rules += udp_rules[i].source.fd != -1;
+    header.rules = htons(header.rules);
+    buffer_append(b, &header, sizeof header);
+    for (int i = 0; i < MAX_RULES; ++i)
+    {
+        struct udp_table *rule = &udp_rules[i];
+        if (-1 == rule->source.fd)
+            continue;
+        struct snapshot_rule entry = {rule_port(rule), htons(rule->size)};
+        buffer_append(b, &entry, sizeof entry);
+        save_limit(&rule->limit, b);
+        for (int j = 0; j < rule->size; ++j)
+        {
+            struct sockaddr_in *addr = &rule->dest[j].addr;
+            struct snapshot_destination dest = {addr->sin_addr.s_addr, addr->sin_port};
+            buffer_append(b, &dest, sizeof dest);
+            save_limit(&rule->dest[j].limit, b);
+        }
+    }
+}
+
+int take(const char **data, size_t *len, void *dst, size_t count)
+{
+    if (*len < count)
+        return -1;
+    memcpy(dst, *data, count);
+    *data += count;
+    *len -= count;
+    return 0;
+}
+
+int load_limit(const char **data, size_t *len, struct limit *l, uint64_t now)
+{
+    struct snapshot_limit entry;
+    if (take(data, len, &entry, sizeof entry))
+        return -1;
+    limit_set(l, ntohl(entry.pps), ntohl(entry.bps), now);
+    return 0;
+}
+
+// Rebuilds the rules saved by save_rules. Their sockets are bound anew,
+// unless fds holds the ones of the process that saved them. Returns -1 if
+// the data is malformed or does not match the sockets passed.
+int load_rules(struct server *server, const char *data, size_t len, int *fds, int nfds)
+{
+    struct snapshot_header header;
+    uint64_t now = now_ns();
+    if (take(&data, &len, &header, sizeof header) || ntohl(header.magic) != SNAPSHOT_MAGIC ||
+        ntohs(header.version) < 1 || ntohs(header.version) > SNAPSHOT_VERSION ||
+        ntohs(header.rules) > MAX_RULES || (fds && nfds != ntohs(header.rules)))
+        return -1;
+    bool limits = ntohs(header.version) >= 2;
+    for (int i = 0; i < ntohs(header.rules); ++i)
+    {
+        struct udp_table *rule = &server->udp_rules[i];
+        struct snapshot_rule entry;
+        if (take(&data, &len, &entry, sizeof entry))
+            return -1;
+        int fd = fds ? fds[i] : bind_inet_socket(ntohs(entry.port), SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        reactor_add(&server->reactor, &rule->source, fd, EPOLLIN, forward_datagram);
+        if (limits && load_limit(&data, &len, &rule->limit, now))
+            return -1;
+        for (int j = 0; j < ntohs(entry.size); ++j)
+        {
+            struct snapshot_destination dest;
+            if (take(&data, &len, &dest, sizeof dest))
+                return -1;
+            struct sockaddr_in addr;
+            memset(&addr, 0, sizeof addr);
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = dest.addr;
+            addr.sin_port = dest.port;
+            struct destination *d = add_destination(rule, addr);
+            if (limits && load_limit(&data, &len, &d->limit, now))
+                return -1;
+        }
+    }
+    return len ? -1 : 0;
+}
+
+// Replaces the snapshot file, so a crash never leaves half of one behind.
+void write_snapshot(struct server *server)
+{
+    if (!server->snapshot)
         return;
-    uint16_t port = atoi(lport);
-    if (!strcmp(cmd, "fwd"))
-        return fwd(port, udp_rules);
-    if (!strcmp(cmd, "close"))
-        return my_close(port, udp_rules);
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof tmp, "%s.tmp", server->snapshot);
+    buffer b = {0};
+    save_rules(server->udp_rules, &b);
+    int fd = TEMP_FAILURE_RETRY(open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+    if (fd < 0)
+        ERR("open");
+    if (bulk_write(fd, b.data + b.start, b.len) < 0)
+        ERR("write");
+    if (fsync(fd))
+        ERR("fsync");
+    if (TEMP_FAILURE_RETRY(close(fd)))
+        ERR("close");
+    if (rename(tmp, server->snapshot))
+        ERR("rename");
+    buffer_free(&b);
 }
 
-ssize_t bulk_read(int fd, char *buf, size_t count)
+void read_snapshot(struct server *server)
 {
-    int c;
-    size_t len = 0;
-    do
+    int fd = TEMP_FAILURE_RETRY(open(server->snapshot, O_RDONLY | O_CLOEXEC));
+    if (fd < 0)
     {
-        c = TEMP_FAILURE_RETRY(read(fd, buf, count));
-        if (c < 0)
-            return c;
-        if (0 == c)
-            return len;
-        buf += c;
-        len += c;
-        count -= c;
-    } while (count > 0);
-    return len;
+        if (ENOENT == errno)
+            return;
+        ERR("open");
+    }
+    buffer b = {0};
+    ssize_t count;
+    while ((count = TEMP_FAILURE_RETRY(read(fd, buffer_reserve(&b, 4096), 4096))) > 0)
+        b.len += count;
+    if (count < 0)
+        ERR("read");
+    if (TEMP_FAILURE_RETRY(close(fd)))
+        ERR("close");
+    if (load_rules(server, b.data + b.start, b.len, NULL, 0))
+    {
+        fprintf(stderr, "%s: not a valid snapshot\n", server->snapshot);
+        exit(EXIT_FAILURE);
+    }
+    buffer_free(&b);
 }
 
-ssize_t bulk_write(int fd, char *buf, size_t count)
+void parse(reactor *r, char *buf, struct udp_table *udp_rules, int fd)
 {
-    int c;
-    size_t len = 0;
-    do
+    struct server *server = container_of(r, struct server, reactor);
+    char *cmd = strtok(buf, " ");
+    if (!cmd)
+        return;
+    char *lport = strtok(NULL, " ");
+    if (!lport)
+        return;
+    uint16_t port = atoi(lport);
+    if (!strcmp(cmd, "fwd"))
+        fwd(r, port, udp_rules);
+    else if (!strcmp(cmd, "close"))
+        my_close(port, udp_rules, &server->capture);
+    else if (!strcmp(cmd, "limit"))
+        limit(r, port, udp_rules);
+    else
     {
-        c = TEMP_FAILURE_RETRY(write(fd, buf, count));
-        if (c < 0)
-            return c;
-        buf += c;
-        len += c;
-        count -= c;
-    } while (count > 0);
-    return len;
+        if (!strcmp(cmd, "stats"))
+            stats(port, udp_rules, fd);
+        else if (!strcmp(cmd, "capture"))
+            capture(server, port, fd);
+        return;
+    }
+    write_snapshot(server);
 }
 
 void communicate(int socketfd, bool deny)
@@ -232,196 +972,280 @@ void communicate(int socketfd, bool deny)
         snprintf(buf, sizeof buf, "At most %d connections are allowed!\n", MAX_CLIENTS);
     else
         snprintf(buf, sizeof buf, "Hello\n");
-    if (bulk_write(socketfd, buf, strlen(buf)) < 0 && errno != EPIPE)
+    if (bulk_write(socketfd, buf, strlen(buf)) < 0 && errno != EPIPE && errno != EAGAIN)
         ERR("write");
 }
 
-int add_new_client(int socketfd)
+void drop_client(struct client *client)
 {
-    int fd = TEMP_FAILURE_RETRY(accept(socketfd, NULL, NULL));
-    if (fd < 0)
+    if (TEMP_FAILURE_RETRY(close(client->source.fd)))
+        ERR("close");
+    client->source.fd = -1;
+    reader_reset(&client->reader);
+}
+
+// Applies the complete command lines of a control connection.
+void interact_with_client(reactor *r, source *s, uint32_t events)
+{
+    struct server *server = container_of(r, struct server, reactor);
+    struct client *client = container_of(s, struct client, source);
+    if (s->fd < 0)
+        return;
+    int count = reader_fill(&client->reader, s->fd);
+    if (count < 0)
     {
-        if (EAGAIN == errno || EWOULDBLOCK == errno)
-            return -1;
-        ERR("accept");
+        if (EAGAIN == errno)
+            return;
+        if (errno != ECONNRESET)
+            ERR("read");
     }
-    return fd;
+    char *line;
+    while ((line = reader_line(&client->reader)))
+        parse(r, line, server->udp_rules, s->fd);
+    if (count <= 0)
+        drop_client(client);
 }
 
-void do_server(int tcp_socket)
+void accept_client(reactor *r, source *s, uint32_t events)
 {
-    int tcp_clients[MAX_CLIENTS];
+    struct server *server = container_of(r, struct server, reactor);
+    int fd = add_new_client(s->fd);
+    if (fd == -1)
+        return;
+    set_nonblocking(fd);
     for (int i = 0; i < MAX_CLIENTS; ++i)
-        tcp_clients[i] = -1;
-
-    struct udp_table udp_rules[MAX_RULES];
-    for (int i = 0; i < MAX_RULES; ++i)
     {
-        udp_rules[i].udp_socket = -1;
-        udp_rules[i].addr = NULL;
-        udp_rules[i].size = 0;
+        struct client *client = &server->tcp_clients[i];
+        if (-1 == client->source.fd)
+        {
+            communicate(fd, false);
+            reactor_add(r, &client->source, fd, EPOLLIN, interact_with_client);
+            return;
+        }
     }
+    communicate(fd, true);
+    if (TEMP_FAILURE_RETRY(close(fd)))
+        ERR("close");
+}
 
-    fd_set readfds;
-    sigset_t old_mask, mask;
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGINT);
-    sigprocmask(SIG_BLOCK, &mask, &old_mask);
-    char buf[MAX_SIZE];
+void stop_server(reactor *r, int sig)
+{
+    reactor_stop(r);
+}
 
-    while (do_work)
+struct sockaddr_un make_unix_address(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof addr.sun_path)
     {
-        FD_ZERO(&readfds);
-        FD_SET(tcp_socket, &readfds);
-        int maxfd = tcp_socket;
-        for (int i = 0; i < MAX_CLIENTS + MAX_RULES; ++i)
-        {
-            int fd = -1;
-            if (i < MAX_CLIENTS)
-                fd = tcp_clients[i];
-            else
-                fd = udp_rules[i - MAX_CLIENTS].udp_socket;
-            if (fd != -1)
-            {
-                FD_SET(fd, &readfds);
-                if (fd > maxfd)
-                    maxfd = fd;
-            }
-        }
-
-        if (pselect(maxfd + 1, &readfds, NULL, NULL, NULL, &old_mask) > 0)
-        {
-            if (FD_ISSET(tcp_socket, &readfds))
-            {
-                int fd = add_new_client(tcp_socket);
-                if (fd != -1)
-                {
-                    int i = 0;
-                    for (; i < MAX_CLIENTS; ++i)
-                        if (-1 == tcp_clients[i])
-                        {
-                            communicate(fd, false);
-                            tcp_clients[i] = fd;
-                            break;
-                        }
-                    if (MAX_CLIENTS == i)
-                    {
-                        communicate(fd, true);
-                        if (TEMP_FAILURE_RETRY(close(fd)))
-                            ERR("close");
-                    }
-                }
-            }
-
-            else
-            {
-                for (int i = 0; i < MAX_CLIENTS; ++i)
-                {
-                    int fd = tcp_clients[i];
-                    if (FD_ISSET(fd, &readfds))
-                    {
-                        int count = TEMP_FAILURE_RETRY(read(fd, buf, sizeof buf));
-                        if (count > 0)
-                        {
-                            int len = strchr(buf, '\n') - buf + 2;
-                            buf[len - 1] = '\0';
-                            parse(buf, udp_rules);
-                        }
-                        else if (!count)
-                        {
-                            if (TEMP_FAILURE_RETRY(close(fd)))
-                                ERR("close");
-                            tcp_clients[i] = -1;
-                        }
-                        else
-                            ERR("read");
-                    }
-                }
-
-                for (int i = 0; i < MAX_RULES; ++i)
-                {
-                    int fd = udp_rules[i].udp_socket;
-                    if (FD_ISSET(fd, &readfds))
-                    {
-                        int count = TEMP_FAILURE_RETRY(recv(fd, buf, sizeof buf, 0));
-                        if (count > 0)
-                        {
-                            int len = strchr(buf, '\n') - buf + 2;
-                            buf[len - 1] = '\0';
-                            for (int j = 0; j < udp_rules[i].size; ++j)
-                                if (TEMP_FAILURE_RETRY(sendto(fd, buf, len, 0,
-                                                              (struct sockaddr *)&udp_rules[i].addr[j], sizeof udp_rules[i].addr[j])) < 0)
-                                    ERR("sendto");
-                        }
-                        else if (!count)
-                        {
-                            if (TEMP_FAILURE_RETRY(close(fd)))
-                                ERR("close");
-                            udp_rules[i].udp_socket = -1;
-                            free(udp_rules[i].addr);
-                            udp_rules[i].addr = NULL;
-                            udp_rules[i].size = 0;
-                        }
-                        else
-                            ERR("recv");
-                    }
-                }
-            }
-        }
-        else if (errno != EINTR)
-            ERR("pselect");
+        fprintf(stderr, "%s: path too long\n", path);
+        exit(EXIT_FAILURE);
     }
-    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    strcpy(addr.sun_path, path);
+    return addr;
+}
 
-    for (int i = 0; i < MAX_CLIENTS; ++i)
+// Passes the listening socket, the rule sockets and the rule table to a
+// new binary and stops. The sockets stay open in the new process, so
+// datagrams arriving meanwhile wait in their receive queues.
+void hand_over(reactor *r, source *s, uint32_t events)
+{
+    struct server *server = container_of(r, struct server, reactor);
+    int fd = add_new_client(s->fd);
+    if (fd < 0)
+        return;
+    int fds[MAX_RULES + 1];
+    int nfds = 0;
+    fds[nfds++] = server->listener.fd;
+    for (int i = 0; i < MAX_RULES; ++i)
+        if (server->udp_rules[i].source.fd != -1)
+            fds[nfds++] = server->udp_rules[i].source.fd;
+    buffer state = {0};
+    save_rules(server->udp_rules, &state);
+
+    char control[CMSG_SPACE(sizeof fds)];
+    memset(control, 0, sizeof control);
+    struct iovec iov = {state.data + state.start, state.len};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                         .msg_controllen = CMSG_SPACE(nfds * sizeof(int))};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    ssize_t count = TEMP_FAILURE_RETRY(sendmsg(fd, &msg, 0));
+    if (count < 0 || bulk_write(fd, state.data + state.start + count, state.len - count) < 0)
     {
-        int fd = tcp_clients[i];
-        if (fd != -1)
-            if (TEMP_FAILURE_RETRY(close(fd)))
-                ERR("close");
+        if (errno != EPIPE && errno != ECONNRESET)
+            ERR("sendmsg");
+        // the new binary is gone, so keep forwarding
+        fprintf(stderr, "upgrade failed\n");
     }
+    else
+    {
+        server->handed_over = true;
+        reactor_stop(r);
+    }
+    if (TEMP_FAILURE_RETRY(close(fd)))
+        ERR("close");
+    buffer_free(&state);
+}
 
-    for (int i = 0; i < MAX_RULES; ++i)
+// Takes the sockets and the rules over from a running server listening on
+// the upgrade path. Returns false if there is none.
+bool take_over(struct server *server)
+{
+    int fd = make_socket(AF_UNIX, SOCK_STREAM);
+    struct sockaddr_un addr = make_unix_address(server->upgrade);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof addr))
     {
-        int fd = udp_rules[i].udp_socket;
-        if (fd != -1)
-        {
-            if (TEMP_FAILURE_RETRY(close(fd)))
-                ERR("close");
-            free(udp_rules[i].addr);
-        }
+        if (errno != ENOENT && errno != ECONNREFUSED)
+            ERR("connect");
+        if (TEMP_FAILURE_RETRY(close(fd)))
+            ERR("close");
+        return false;
+    }
+    buffer state = {0};
+    int fds[MAX_RULES + 1];
+    char control[CMSG_SPACE(sizeof fds)];
+    struct iovec iov = {buffer_reserve(&state, 4096), 4096};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                         .msg_controllen = sizeof control};
+    ssize_t count = TEMP_FAILURE_RETRY(recvmsg(fd, &msg, MSG_CMSG_CLOEXEC));
+    if (count < 0)
+        ERR("recvmsg");
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || (msg.msg_flags & MSG_CTRUNC))
+    {
+        fprintf(stderr, "upgrade: no sockets received\n");
+        exit(EXIT_FAILURE);
+    }
+    int nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+    // the old server closes the connection once everything is sent
+    for (state.len = count; count > 0; state.len += count)
+        if ((count = TEMP_FAILURE_RETRY(read(fd, buffer_reserve(&state, 4096), 4096))) < 0)
+            ERR("read");
+    if (TEMP_FAILURE_RETRY(close(fd)))
+        ERR("close");
+    if (nfds < 1 || load_rules(server, state.data + state.start, state.len, fds + 1, nfds - 1))
+    {
+        fprintf(stderr, "upgrade: malformed rule table\n");
+        exit(EXIT_FAILURE);
     }
+    reactor_add(&server->reactor, &server->listener, fds[0], EPOLLIN, accept_client);
+    buffer_free(&state);
+    return true;
 }
 
-void sigint_handler(int sig)
+// Listens for the next binary on the upgrade path.
+void await_successor(struct server *server)
 {
-    do_work = 0;
+    struct sockaddr_un addr = make_unix_address(server->upgrade);
+    int fd = make_socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (unlink(server->upgrade) && errno != ENOENT)
+        ERR("unlink");
+    if (bind(fd, (struct sockaddr *)&addr, sizeof addr))
+        ERR("bind");
+    if (listen(fd, 1))
+        ERR("listen");
+    reactor_add(&server->reactor, &server->successor, fd, EPOLLIN, hand_over);
 }
 
-void set_handler(void (*f)(int), int sig)
+void do_server(int port, const char *snapshot, const char *upgrade)
 {
-    struct sigaction act;
-    memset(&act, 0, sizeof act);
-    act.sa_handler = f;
-    if (sigaction(sig, &act, NULL))
-        ERR("sigaction");
+    struct server *server = malloc(sizeof(*server));
+    if (!server)
+        ERR("malloc");
+    reactor *r = &server->reactor;
+    reactor_init(r);
+    reactor_signal(r, SIGINT, stop_server);
+    server->snapshot = snapshot;
+    server->upgrade = upgrade;
+    server->handed_over = false;
+    server->successor.fd = -1;
+    memset(&server->capture, 0, sizeof server->capture);
+
+    for (int i = 0; i < MAX_CLIENTS; ++i)
+    {
+        server->tcp_clients[i].source.fd = -1;
+        reader_init(&server->tcp_clients[i].reader, MAX_SIZE);
+    }
+
+    struct udp_table *udp_rules = server->udp_rules;
+    memset(udp_rules, 0, sizeof server->udp_rules);
+    for (int i = 0; i < MAX_RULES; ++i)
+        udp_rules[i].source.fd = -1;
+
+    if (upgrade && take_over(server))
+        write_snapshot(server);
+    else
+    {
+        reactor_add(r, &server->listener, bind_inet_socket(port, SOCK_STREAM | SOCK_NONBLOCK, MAX_CLIENTS),
+                    EPOLLIN, accept_client);
+        if (snapshot)
+            read_snapshot(server);
+    }
+    if (upgrade)
+        await_successor(server);
+    reactor_run(r);
+
+    for (int i = 0; i < MAX_CLIENTS; ++i)
+    {
+        struct client *client = &server->tcp_clients[i];
+        if (client->source.fd != -1)
+            drop_client(client);
+        reader_free(&client->reader);
+    }
+
+    for (int i = 0; i < MAX_RULES; ++i)
+        if (udp_rules[i].source.fd != -1)
+            free_rule(&udp_rules[i]);
+    capture_shutdown(&server->capture);
+    if (upgrade)
+    {
+        // after a hand-over the path belongs to the new binary
+        if (!server->handed_over && unlink(upgrade))
+            ERR("unlink");
+        if (TEMP_FAILURE_RETRY(close(server->successor.fd)))
+            ERR("close");
+    }
+    if (TEMP_FAILURE_RETRY(close(server->listener.fd)))
+        ERR("close");
+    reactor_destroy(r);
+    free(server);
 }
 
 void usage(char *name)
 {
-    fprintf(stderr, "USAGE: %s port\n", name);
+    fprintf(stderr, "USAGE: %s [-s snapshot] [-u upgrade_socket] port\n", name);
+    fprintf(stderr, "-s rule table saved on every change and loaded at startup\n");
+    fprintf(stderr, "-u a server already listening there hands its sockets over\n");
     exit(EXIT_FAILURE);
 }
 
 int main(int argc, char *argv[])
 {
-    if (argc != 2)
+    const char *snapshot = NULL;
+    const char *upgrade = NULL;
+    int c;
+    while ((c = getopt(argc, argv, "s:u:")) != -1)
+        switch (c)
+        {
+        case 's':
+            snapshot = optarg;
+            break;
+        case 'u':
+            upgrade = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    if (argc - optind != 1)
         usage(argv[0]);
     set_handler(SIG_IGN, SIGPIPE);
-    set_handler(sigint_handler, SIGINT);
-    int tcp_socket = bind_inet_socket(atoi(argv[1]), SOCK_STREAM);
-    do_server(tcp_socket);
-    if (TEMP_FAILURE_RETRY(close(tcp_socket)))
-        ERR("close");
+    do_server(atoi(argv[optind]), snapshot, upgrade);
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -0,0 +1,429 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "reactor.h"
+#include "util.h"
+
+#define MAX_SIZE 4096
+#define PENDING 64
+#define BUCKETS (61 * 16)
+
+enum bot_state
+{
+    BOT_CONNECTING,
+    BOT_WAITING,
+    BOT_PLAYING
+};
+
+// One simulated player. pending holds the send times of the moves that
+// have not been answered yet, oldest first. Lines longer than MAX_SIZE,
+// such as huge boards, are dropped by the reader.
+typedef struct
+{
+    source source;  // fd is -1 between connections
+    timer move;     // armed while playing
+    reader reader;
+    enum bot_state state;
+    int player;
+    int initial_board;  // the board sent with "The game has started." is no answer
+    uint64_t connected;
+    uint64_t pending[PENDING];
+    int head, count;
+    unsigned random;
+} bot;
+
+// Log-linear latency histogram: 16 sub-buckets per power of two of nanoseconds.
+typedef struct
+{
+    long count[BUCKETS];
+    long total;
+    uint64_t max;
+} histogram;
+
+typedef struct
+{
+    uint16_t port;
+    int connections;
+    double rate;    // moves per second of every bot
+    int duration;   // seconds
+    int probe;      // answer is a board sent for "0" instead of a pushed delta
+    pid_t server;
+} options;
+
+typedef struct
+{
+    long connects, games, wins, losses, moves, answers;
+    histogram start, answer;
+} stats;
+
+// All bots run on one reactor, with a timer for the progress lines and
+// one for the end of the run.
+typedef struct
+{
+    reactor reactor;
+    const options *opts;
+    bot *bots;
+    stats st, last;
+    uint64_t start;
+    timer report, end;
+} fleet;
+
+void usage(char *name)
+{
+    fprintf(stderr, "USAGE: %s [-c connections] [-r moves_per_second] [-d seconds] [-q] [-p server_pid] port\n", name);
+    fprintf(stderr, "bots expect a server started with -u and time the delta of their own move;\n");
+    fprintf(stderr, "with -q they follow every move with 0 and time the board instead\n");
+    exit(EXIT_FAILURE);
+}
+
+int bucket(uint64_t ns)
+{
+    if (ns < 16)
+        return ns;
+    int k = 63 - __builtin_clzll(ns);
+    return (k - 3) * 16 + ((ns >> (k - 4)) & 15);
+}
+
+uint64_t bucket_value(int index)
+{
+    if (index < 16)
+        return index;
+    int k = index / 16 + 3;
+    return (uint64_t)(16 + index % 16) << (k - 4);
+}
+
+void histogram_add(histogram *h, uint64_t ns)
+{
+    ++h->count[bucket(ns)];
+    ++h->total;
+    if (ns > h->max)
+        h->max = ns;
+}
+
+uint64_t percentile(histogram *h, double p)
+{
+    long rank = h->total * p, seen = 0;
+    for (int i = 0; i < BUCKETS; ++i)
+        if ((seen += h->count[i]) > rank)
+            return bucket_value(i);
+    return h->max;
+}
+
+void print_histogram(const char *name, histogram *h)
+{
+    if (!h->total)
+        return;
+    printf("%s: n %ld p50 %.1fus p90 %.1fus p99 %.1fus p99.9 %.1fus max %.1fus\n", name, h->total,
+           percentile(h, 0.5) / 1e3, percentile(h, 0.9) / 1e3, percentile(h, 0.99) / 1e3,
+           percentile(h, 0.999) / 1e3, h->max / 1e3);
+}
+
+// Server CPU time in seconds, from /proc/<pid>/stat.
+double cpu_time(pid_t pid)
+{
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+    size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[len] = 0;
+    char *p = strrchr(buf, ')');
+    unsigned long utime, stime;
+    // fields after the command: state ppid pgrp session tty tpgid flags minflt cminflt majflt cmajflt utime stime
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        return -1;
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+void bot_event(reactor *r, source *s, uint32_t events);
+
+void bot_connect(fleet *f, bot *b)
+{
+    int fd = make_socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK);
+    b->state = BOT_CONNECTING;
+    b->count = b->head = 0;
+    reader_reset(&b->reader);
+    b->connected = now_ns();
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(f->opts->port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) && errno != EINPROGRESS)
+        ERR("connect");
+    reactor_add(&f->reactor, &b->source, fd, EPOLLIN | EPOLLOUT, bot_event);
+    ++f->st.connects;
+}
+
+void bot_close(fleet *f, bot *b)
+{
+    reactor_cancel(&f->reactor, &b->move);
+    if (TEMP_FAILURE_RETRY(close(b->source.fd)))
+        ERR("close");
+    b->source.fd = -1;
+}
+
+uint64_t move_interval(bot *b, const options *opts)
+{
+    // uniform jitter keeps the bots from moving in lockstep
+    return 1e9 / opts->rate * (0.5 + (double)rand_r(&b->random) / RAND_MAX);
+}
+
+void bot_answer(bot *b, stats *st, uint64_t now)
+{
+    if (!b->count)
+        return;
+    histogram_add(&st->answer, now - b->pending[b->head]);
+    b->head = (b->head + 1) % PENDING;
+    --b->count;
+    ++st->answers;
+}
+
+// Returns 1 if the delta contains a cell taken by this bot.
+int own_delta(const char *line, int player)
+{
+    for (const char *p = strchr(line, '='); p; p = strchr(p + 1, '='))
+        if (strtol(p + 1, NULL, 10) == player)
+            return 1;
+    return 0;
+}
+
+// Handles one line from the server. Returns 1 when the bot's game is over.
+int bot_line(fleet *f, bot *b, char *line)
+{
+    const options *opts = f->opts;
+    stats *st = &f->st;
+    uint64_t now = f->reactor.now;
+    if (!strncmp(line, "You are player#", 15))
+    {
+        b->player = strtol(line + 15, NULL, 10);
+        b->state = BOT_WAITING;
+    }
+    else if (!strcmp(line, "The game has started."))
+    {
+        histogram_add(&st->start, now - b->connected);
+        b->state = BOT_PLAYING;
+        b->initial_board = 1;
+        reactor_timer(&f->reactor, &b->move, now + move_interval(b, opts));
+    }
+    else if ('|' == line[0] || '#' == line[0])
+    {
+        if (b->initial_board)
+            b->initial_board = 0;
+        else if (opts->probe)
+            bot_answer(b, st, now);
+    }
+    else if ('@' == line[0])
+    {
+        if (!opts->probe && own_delta(line, b->player))
+            bot_answer(b, st, now);
+    }
+    else if (!strncmp(line, "You lost", 8))
+    {
+        if (strstr(line, "out of the board"))
+            bot_answer(b, st, now);
+        ++st->losses;
+        return 1;
+    }
+    else if (!strcmp(line, "You have won!"))
+    {
+        ++st->wins;
+        ++st->games;
+        return 1;
+    }
+    return 0;
+}
+
+// Reads what the server sent. Returns 1 when the connection is done.
+int bot_read(fleet *f, bot *b)
+{
+    ssize_t count = reader_fill(&b->reader, b->source.fd);
+    if (count < 0)
+    {
+        if (EAGAIN == errno)
+            return 0;
+        if (ECONNRESET == errno)
+            return 1;
+        ERR("read");
+    }
+    if (!count)
+        return 1;
+    char *line;
+    while ((line = reader_line(&b->reader)))
+        if (bot_line(f, b, line))
+            return 1;
+    return 0;
+}
+
+void bot_event(reactor *r, source *s, uint32_t events)
+{
+    fleet *f = container_of(r, fleet, reactor);
+    bot *b = container_of(s, bot, source);
+    if (BOT_CONNECTING == b->state && events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+    {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &error, &len))
+            ERR("getsockopt");
+        if (error)
+        {
+            errno = error;
+            ERR("connect");
+        }
+        reactor_modify(r, s, EPOLLIN);
+        b->state = BOT_WAITING;
+    }
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR) && bot_read(f, b))
+    {
+        // start over in a new game to keep the load constant
+        bot_close(f, b);
+        bot_connect(f, b);
+    }
+}
+
+void bot_move(reactor *r, timer *t)
+{
+    fleet *f = container_of(r, fleet, reactor);
+    bot *b = container_of(t, bot, move);
+    if (b->count < PENDING)
+    {
+        char buf[16];
+        int step = rand_r(&b->random) % 4 - 2;
+        int len = snprintf(buf, sizeof(buf), f->opts->probe ? "%d\n0\n" : "%d\n", step < 0 ? step : step + 1);
+        if (write(b->source.fd, buf, len) == len)
+        {
+            b->pending[(b->head + b->count++) % PENDING] = r->now;
+            ++f->st.moves;
+        }
+    }
+    uint64_t next = t->when + move_interval(b, f->opts);
+    reactor_timer(r, t, next > r->now ? next : r->now);
+}
+
+void report(reactor *r, timer *t)
+{
+    fleet *f = container_of(r, fleet, reactor);
+    int playing = 0;
+    for (int i = 0; i < f->opts->connections; ++i)
+        playing += BOT_PLAYING == f->bots[i].state;
+    stats *st = &f->st, *last = &f->last;
+    printf("%6.1fs: playing %d connects/s %ld games/s %ld moves/s %ld answers/s %ld\n", (r->now - f->start) / 1e9,
+           playing, st->connects - last->connects, st->games - last->games,
+           st->moves - last->moves, st->answers - last->answers);
+    fflush(stdout);
+    *last = *st;
+    reactor_timer(r, t, t->when + 1000000000ULL);
+}
+
+void finish(reactor *r, timer *t)
+{
+    reactor_stop(r);
+}
+
+void interrupt(reactor *r, int sig)
+{
+    reactor_stop(r);
+}
+
+void run_bots(const options *opts)
+{
+    fleet *f = calloc(1, sizeof(*f));
+    if (!f)
+        ERR("calloc");
+    f->opts = opts;
+    if (!(f->bots = calloc(opts->connections, sizeof(*f->bots))))
+        ERR("calloc");
+    reactor *r = &f->reactor;
+    reactor_init(r);
+    reactor_signal(r, SIGINT, interrupt);
+    double cpu = opts->server ? cpu_time(opts->server) : -1;
+    f->start = now_ns();
+    timer_init(&f->report, report);
+    reactor_timer(r, &f->report, f->start + 1000000000ULL);
+    timer_init(&f->end, finish);
+    reactor_timer(r, &f->end, f->start + opts->duration * 1000000000ULL);
+    for (int i = 0; i < opts->connections; ++i)
+    {
+        bot *b = &f->bots[i];
+        b->random = f->start + i;
+        timer_init(&b->move, bot_move);
+        reader_init(&b->reader, MAX_SIZE);
+        bot_connect(f, b);
+    }
+    reactor_run(r);
+    stats *st = &f->st;
+    double seconds = (now_ns() - f->start) / 1e9;
+    printf("--- %d bots, %.1fs ---\n", opts->connections, seconds);
+    printf("connects %ld games %ld (%.1f/s) wins %ld losses %ld moves %ld (%.1f/s) answers %ld\n",
+           st->connects, st->games, st->games / seconds, st->wins, st->losses,
+           st->moves, st->moves / seconds, st->answers);
+    print_histogram("connect-to-start", &st->start);
+    print_histogram("move-to-answer", &st->answer);
+    if (cpu >= 0)
+    {
+        double used = cpu_time(opts->server) - cpu;
+        printf("server cpu: %.2fs (%.1f%% of one core)\n", used, 100 * used / seconds);
+    }
+    for (int i = 0; i < opts->connections; ++i)
+    {
+        bot *b = &f->bots[i];
+        if (b->source.fd >= 0)
+            bot_close(f, b);
+        reader_free(&b->reader);
+    }
+    reactor_destroy(r);
+    free(f->bots);
+    free(f);
+}
+
+int main(int argc, char *argv[])
+{
+    options opts = {.connections = 100, .rate = 10, .duration = 10};
+    int c;
+    while ((c = getopt(argc, argv, "c:r:d:qp:")) != -1)
+        switch (c)
+        {
+        case 'c':
+            opts.connections = strtol(optarg, NULL, 10);
+            break;
+        case 'r':
+            opts.rate = strtod(optarg, NULL);
+            break;
+        case 'd':
+            opts.duration = strtol(optarg, NULL, 10);
+            break;
+        case 'q':
+            opts.probe = 1;
+            break;
+        case 'p':
+            opts.server = strtol(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    if (argc - optind != 1 || opts.connections < 1 || opts.rate <= 0 || opts.duration < 1)
+        usage(argv[0]);
+    opts.port = strtol(argv[optind], NULL, 10);
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit))
+        ERR("getrlimit");
+    limit.rlim_cur = limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit))
+        ERR("setrlimit");
+    set_handler(SIG_IGN, SIGPIPE);
+    run_bots(&opts);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,162 @@
+#ifndef SYNC_GAME_H
+#define SYNC_GAME_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The rules of linear and the format of its event logs, shared with
+// replay so that the logs are checked against the code that wrote them.
+
+#define EMPTY -1
+#define LOG_MAGIC 0x474f4c5241454e4cULL  // "LNEARLOG"
+#define LOG_VERSION 1
+
+// Event log of a game, read by replay. A header is followed by fixed-size
+// records; a record with sequence number 0 ends a log that was not closed.
+enum log_type
+{
+    LOG_PLACE,    // player starts on cell
+    LOG_MOVE,     // player steps by other onto cell, which may be off the board
+    LOG_CAPTURE,  // player is captured on cell by other
+    LOG_WIN,      // player on cell is the last one on the board
+    LOG_LEAVE,    // player's connection is closed
+    LOG_END       // nobody is connected any more
+};
+
+typedef struct
+{
+    uint64_t magic;
+    uint32_t version;
+    int32_t game_id;
+    int32_t board_size;
+    int32_t num_players;
+    uint64_t random;     // state of the generator before the placement
+    uint64_t realtime;   // CLOCK_REALTIME and CLOCK_MONOTONIC when the log
+    uint64_t monotonic;  // was opened, to date the records
+} log_header;
+
+typedef struct
+{
+    uint64_t seq;
+    uint64_t time;  // CLOCK_MONOTONIC, ns
+    int32_t type;
+    int32_t player;
+    int32_t cell;
+    int32_t other;
+} log_record;
+
+// The board of a game is a sparse occupancy index: an open-addressing
+// table with linear probing and at least twice as many slots as players.
+// A slot packs the cell (plus one, so that 0 is a free slot) and its
+// player into one atomic word, so every cell changes with a single atomic
+// operation. random is the state of the game's generator.
+typedef struct
+{
+    int size;
+    int num_players;
+    _Atomic uint64_t *slots;
+    int bits;        // log2 of the number of slots
+    int *positions;  // EMPTY once the piece has left the board
+    uint64_t random;
+} board;
+
+// xorshift64* generator of the game, returns a number in [0, bound)
+static inline uint32_t board_random(board *b, uint32_t bound)
+{
+    b->random ^= b->random >> 12;
+    b->random ^= b->random << 25;
+    b->random ^= b->random >> 27;
+    uint32_t r = (b->random * 0x2545f4914f6cdd1dULL) >> 32;
+    return ((uint64_t)r * bound) >> 32;
+}
+
+static inline size_t board_home(board *b, int cell)
+{
+    return ((uint32_t)cell * 0x9e3779b97f4a7c15ULL) >> (64 - b->bits);
+}
+
+static inline uint64_t board_pack(int cell, int player)
+{
+    return (uint64_t)(cell + 1) << 32 | (uint32_t)player;
+}
+
+static inline int board_cell(uint64_t slot)
+{
+    return (int)(slot >> 32) - 1;
+}
+
+// Finds the slot of a cell, or the free slot where it would go.
+static inline size_t board_slot(board *b, int cell)
+{
+    size_t mask = ((size_t)1 << b->bits) - 1;
+    for (size_t i = board_home(b, cell);; i = (i + 1) & mask)
+    {
+        uint64_t slot = atomic_load_explicit(&b->slots[i], memory_order_relaxed);
+        if (!slot || board_cell(slot) == cell)
+            return i;
+    }
+}
+
+static inline int board_get(board *b, int cell)
+{
+    uint64_t slot = atomic_load_explicit(&b->slots[board_slot(b, cell)], memory_order_relaxed);
+    return slot ? (int)(uint32_t)slot : EMPTY;
+}
+
+// Puts a player on a cell and returns whoever was there.
+static inline int board_exchange(board *b, int cell, int player)
+{
+    uint64_t slot = atomic_exchange(&b->slots[board_slot(b, cell)], board_pack(cell, player));
+    return slot ? (int)(uint32_t)slot : EMPTY;
+}
+
+// Empties a cell if the player is still on it. The slots after it are
+// shifted back so that lookups never need tombstones.
+static inline int board_release(board *b, int cell, int player)
+{
+    size_t mask = ((size_t)1 << b->bits) - 1;
+    size_t hole = board_slot(b, cell);
+    uint64_t expected = board_pack(cell, player);
+    if (!atomic_compare_exchange_strong(&b->slots[hole], &expected, 0))
+        return 0;
+    for (size_t i = (hole + 1) & mask;; i = (i + 1) & mask)
+    {
+        uint64_t slot = atomic_load_explicit(&b->slots[i], memory_order_relaxed);
+        if (!slot)
+            return 1;
+        size_t home = board_home(b, board_cell(slot));
+        if (((i - home) & mask) >= ((i - hole) & mask))
+        {
+            atomic_store_explicit(&b->slots[hole], slot, memory_order_relaxed);
+            atomic_store_explicit(&b->slots[i], 0, memory_order_release);
+            hole = i;
+        }
+    }
+}
+
+// Draws distinct cells for all players with Floyd's sampling, which needs
+// exactly one random number per player, then shuffles who gets which cell.
+static inline void place_players(board *b)
+{
+    int n = b->num_players;
+    for (int i = 0, j = b->size - n; i < n; ++i, ++j)
+    {
+        int cell = board_random(b, j + 1);
+        if (board_get(b, cell) != EMPTY)
+            cell = j;
+        board_exchange(b, cell, i);
+        b->positions[i] = cell;
+    }
+    for (int i = n - 1; i > 0; --i)
+    {
+        int j = board_random(b, i + 1);
+        int cell = b->positions[i];
+        b->positions[i] = b->positions[j];
+        b->positions[j] = cell;
+    }
+    for (int i = 0; i < n; ++i)
+        board_exchange(b, b->positions[i], i);
+}
+
+#endif
@@ -1,355 +1,1436 @@
 #define _GNU_SOURCE
 
 #include <errno.h>
-#include <netdb.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <pthread.h>
-#include <semaphore.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
-#define ERR(source) (perror(source),                                 \
-                     fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
-                     exit(EXIT_FAILURE))
+#include "buffer.h"
+#include "game.h"
+#include "reactor.h"
+#include "trace.h"
+#include "util.h"
 
-#define MAX_PLAYERS 5
+#define MAX_PLAYERS 65536
+#define MAX_BOARD (1 << 30)
+#define MAX_VIEW 4096  // larger boards are shown as a list of occupied cells
 #define MAX_SIZE 100
+#define MAX_OUTPUT (64 * 1024)
+#define GAME_BUCKETS 1024
+#define DIRECTORY_SIZE 65536  // games at once, a new one takes a slot whose game is over
+#define MAX_PROCESSES 64
 
 volatile int do_work = 1;
 
-typedef struct
+typedef struct game game;
+typedef struct worker worker;
+
+// Non-blocking connection watched by a worker, with an output buffer.
+// Everything sent while a worker handles a batch of events is written
+// once, after the batch.
+typedef struct conn
+{
+    source source;  // fd is -1 once closed
+    buffer out;
+    int dirty;
+    int paused;  // input is not read for the time being
+    int lagging; // lost output to MAX_OUTPUT, owes the whole board
+    struct conn *next_dirty;
+} conn;
+
+// A player's commands are lines. The reader holds what has been read but
+// not applied yet: the start of a line, or whole lines held back by the
+// rate limit. due is the theoretical time of the next move of the rate
+// limit (GCRA): a move is let through if it is at most burst - 1 intervals
+// early, otherwise the player is throttled until the resume timer.
+// Every player starts on its own cache line.
+typedef struct linear
 {
-    int *board;
-    int board_size;
-    int num_players;
+    conn conn;
+    game *game;
     int player_number;
-    int *positions;
-    sem_t *semaphores;
-    int *socketfds;
-    pthread_t *threads;
-} linear;
+    reader reader;
+    uint64_t due;
+    timer resume;
+    int hung_up;  // the connection is closed, the moves read before are still due
+} __attribute__((aligned(CACHE_LINE))) linear;
+
+typedef struct spectator
+{
+    conn conn;
+    int game_id;
+    game *game;
+    struct spectator *next;
+} spectator;
+
+// One room of the lobby: every game owns its board and positions.
+// A game is only ever touched by the worker it was handed to.
+// The board (see game.h) takes memory by the number of players, not by
+// the board size.
+// alive counts the pieces left on the board, so reading it never needs a lock.
+// view is the rendered board: small boards are patched in place whenever
+// a cell changes, larger ones are listed again after a change, when asked.
+// delta collects the changes of the current move for the subscribers.
+// A game is the head of its arena: one cache-aligned block holding the
+// players, the slots, the positions and the view, each on its own lines.
+// Games that are over go back to the pool with their arena and the output
+// buffers of their players, so the next game allocates nothing.
+struct game
+{
+    int id;
+    board board;
+    int connected;
+    atomic_int alive;
+    linear *data;
+    spectator *spectators;
+    char *view;
+    int view_len;
+    int field;  // width of a rendered cell without its separator
+    unsigned version;
+    unsigned view_version;
+    char delta[MAX_SIZE];
+    int delta_len;
+    int log_fd;  // -1 without an event log
+    char *log;   // the log file, mapped
+    size_t log_len, log_cap;
+    uint64_t log_seq;
+    worker *worker;
+    game *prev, *next;
+    game *hnext;  // chain of the worker's id lookup table
+};
+
+// Reactor thread serving the games whose id maps to it. New games and
+// spectators arrive through queues guarded by a mutex and are announced
+// on an eventfd.
+struct worker
+{
+    reactor reactor;
+    pthread_t thread;
+    source wake;  // the eventfd
+    pthread_mutex_t mutex;
+    game *incoming;
+    spectator *incoming_spectators;
+    game *games;     // games being played
+    game *table[GAME_BUCKETS];
+    conn *dirty;     // connections with output to write after the batch
+    game *finished;  // games to free once the current batch of events is done
+    spectator *gone; // spectators to free after the batch
+};
+
+// Offsets of the parts of a game's arena; all games of a server have the same.
+typedef struct
+{
+    size_t data, slots, positions, view, size;
+    int bits, field;
+} layout;
+
+int push_updates = 0;
+uint64_t game_seed;
+layout arena;
+pool games;  // games that are over, with their arenas
+uint64_t move_interval = 0;  // ns, 0 when moves are not limited
+uint64_t move_tolerance = 0; // how early a move may come, for bursts
+char *log_directory = NULL;
+
+// The game directory, shared by the server processes. A process claims a
+// slot for its game with a compare-and-swap of the state and only then
+// writes it, with the id last, so whoever finds the id it looks for reads
+// the rest of that game. Nobody else writes a slot until its game is over.
+// The seats of the open room are claimed by any process with a
+// compare-and-swap of the seat count, so rooms fill up in turn whichever
+// process accepted the player, and the players go to the room's owner.
+enum room_state
+{
+    ROOM_FREE,     // may be claimed
+    ROOM_CLAIMED,  // being written by the process that claimed it
+    ROOM_WAITING,  // filling up with players
+    ROOM_PLAYING,
+    ROOM_OVER      // may be claimed again
+};
+
+typedef struct
+{
+    atomic_int state;
+    atomic_int id;
+    atomic_int owner;         // index of the server process
+    _Atomic uint64_t seats;   // id << 32 | seats taken
+    atomic_int players;       // seated in the room, or still connected during the game
+    atomic_int winner;        // EMPTY until somebody wins
+} room;
+
+typedef struct
+{
+    atomic_uint next_game;  // wraps, ids are taken modulo INT_MAX + 1
+    atomic_int open;  // the room taking players, -1 until somebody opens one
+    atomic_long started, finished;
+    room rooms[DIRECTORY_SIZE];
+} directory;
+
+directory *dir;
+int process_index = 0;
+int num_processes = 1;
+int *handoffs;       // where to send a player or spectator of another process's game
+int handoff_in = -1; // where this process receives them
 
 void usage(char *name)
 {
-    fprintf(stderr, "USAGE: %s port_number num_players board_size\n", name);
+    fprintf(stderr, "USAGE: %s [-p processes] [-w workers] [-s spectator_port] [-u] [-r moves_per_second] [-b burst] [-l log_directory] port_number num_players board_size\n", name);
+    fprintf(stderr, "players send one command per line\n");
+    fprintf(stderr, "-p starts that many server processes on the port, with -w workers each\n");
+    fprintf(stderr, "-u sends every board change to the players too\n");
+    fprintf(stderr, "-r limits the commands of every player, -b lets that many through at once\n");
+    fprintf(stderr, "-l writes the events of every game to log_directory/game-<pid>-<game>.log\n");
+    fprintf(stderr, "spectators send a game number and then receive the board and its changes\n");
     exit(EXIT_FAILURE);
 }
 
 void verify_args(int num_players, int board_size)
 {
-    if (num_players < 2 || num_players > 5 ||
-        board_size < num_players || board_size > 5 * num_players)
+    if (num_players < 2 || num_players > MAX_PLAYERS ||
+        board_size < num_players || board_size > MAX_BOARD)
         exit(EXIT_FAILURE);
 }
 
-void sigint_handler(int sig)
+// splitmix64, used to derive a well-mixed seed for every game
+uint64_t mix_seed(uint64_t x)
 {
-    do_work = 0;
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
 }
 
-void set_handler(void (*f)(int), int sig)
+void print_cell(char *field, int width, int player)
 {
-    struct sigaction act;
-    memset(&act, 0, sizeof(act));
-    act.sa_handler = f;
-    if (sigaction(sig, &act, NULL))
-        ERR("sigaction");
+    char tmp[16];
+    if (EMPTY == player)
+        memset(field, ' ', width);
+    else
+    {
+        snprintf(tmp, sizeof(tmp), "%*d", width, player);
+        memcpy(field, tmp, width);
+    }
+    field[width] = '|';
 }
 
-int make_socket(int domain, int type)
+// Renders the board. Small boards are drawn once and then only patched;
+// larger ones are listed as cell=player pairs, at most once per version.
+void print_board(game *g)
 {
-    int socketfd = socket(domain, type, 0);
-    if (socketfd < 0)
-        ERR("socket");
-    return socketfd;
+    if (g->board.size <= MAX_VIEW)
+    {
+        g->view[0] = '|';
+        for (int i = 0; i < g->board.size; ++i)
+            print_cell(g->view + 1 + i * (g->field + 1), g->field, EMPTY);
+        for (int i = 0; i < g->board.num_players; ++i)
+            if (g->board.positions[i] != EMPTY)
+                print_cell(g->view + 1 + g->board.positions[i] * (g->field + 1), g->field, i);
+        g->view_len = 1 + g->board.size * (g->field + 1) + 1;
+        g->view[g->view_len - 1] = '\n';
+    }
+    else
+    {
+        char *p = g->view;
+        p += sprintf(p, "#%d", g->board.size);
+        for (int i = 0; i < g->board.num_players; ++i)
+            if (g->board.positions[i] != EMPTY)
+                p += sprintf(p, " %d=%d", g->board.positions[i], i);
+        *p++ = '\n';
+        g->view_len = p - g->view;
+    }
+    g->view_version = g->version;
 }
 
-int bind_tcp_socket(uint16_t port)
+char *board_view(game *g)
 {
-    int socketfd = make_socket(PF_INET, SOCK_STREAM);
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-    int t = 1;
-    if (setsockopt(socketfd, SOL_SOCKET, SO_REUSEADDR, &t, sizeof(t)))
-        ERR("setsockopt");
-    if (bind(socketfd, (struct sockaddr *)&addr, sizeof(addr)))
-        ERR("bind");
-    if (listen(socketfd, MAX_PLAYERS))
-        ERR("listen");
-    return socketfd;
+    if (g->view_version != g->version)
+        print_board(g);
+    return g->view;
 }
 
-int add_new_client(int socketfd)
+// Records a changed cell in the cached view and in the pending delta.
+void update_board(game *g, int cell, int player)
 {
-    int sock = TEMP_FAILURE_RETRY(accept(socketfd, NULL, NULL));
-    if (sock < 0)
+    if (g->board.size <= MAX_VIEW)
+        print_cell(g->view + 1 + cell * (g->field + 1), g->field, player);
+    g->delta_len += snprintf(g->delta + g->delta_len, sizeof(g->delta) - g->delta_len,
+                             " %d=%d", cell, player);
+}
+
+// Creates the log file of a game and maps it. The file grows by doubling,
+// so appending a record is a copy into the mapping and never a system call.
+void log_open(game *g)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/game-%d-%d.log", log_directory, getpid(), g->id);
+    if ((g->log_fd = TEMP_FAILURE_RETRY(open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644))) < 0)
+        ERR("open");
+    size_t page = sysconf(_SC_PAGESIZE);
+    g->log_cap = (sizeof(log_header) + (2 * g->board.num_players + 64) * sizeof(log_record) + page - 1) / page * page;
+    if (ftruncate(g->log_fd, g->log_cap))
+        ERR("ftruncate");
+    if ((g->log = mmap(NULL, g->log_cap, PROT_READ | PROT_WRITE, MAP_SHARED, g->log_fd, 0)) == MAP_FAILED)
+        ERR("mmap");
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    log_header header = {.magic = LOG_MAGIC,
+                         .version = LOG_VERSION,
+                         .game_id = g->id,
+                         .board_size = g->board.size,
+                         .num_players = g->board.num_players,
+                         .random = mix_seed(game_seed + g->id),
+                         .realtime = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec,
+                         .monotonic = now_ns()};
+    memcpy(g->log, &header, sizeof(header));
+    g->log_len = sizeof(header);
+}
+
+void log_event(game *g, enum log_type type, int player, int cell, int other)
+{
+    if (g->log_fd < 0)
+        return;
+    if (g->log_len + sizeof(log_record) > g->log_cap)
     {
-        if (EAGAIN == errno || EWOULDBLOCK == errno)
-            return -1;
-        ERR("accept");
+        if (ftruncate(g->log_fd, 2 * g->log_cap))
+            ERR("ftruncate");
+        if ((g->log = mremap(g->log, g->log_cap, 2 * g->log_cap, MREMAP_MAYMOVE)) == MAP_FAILED)
+            ERR("mremap");
+        g->log_cap *= 2;
     }
-    return sock;
+    log_record record = {++g->log_seq, now_ns(), type, player, cell, other};
+    memcpy(g->log + g->log_len, &record, sizeof(record));
+    g->log_len += sizeof(record);
 }
 
-ssize_t bulk_write(int fd, char *buf, size_t count)
+// Cuts the file to the records written.
+void log_close(game *g)
 {
-    int c;
-    size_t len = 0;
-    do
-    {
-        c = TEMP_FAILURE_RETRY(write(fd, buf, count));
-        if (c < 0)
-            return c;
-        buf += c;
-        len += c;
-        count -= c;
-    } while (count > 0);
-    return len;
-}
-
-int my_random(int board_size)
-{
-    static int count = 0;
-    static int *positions = NULL;
-    if (board_size > 0)
-    {
-        if (positions)
-            free(positions);
-        positions = malloc(board_size * sizeof(*positions));
-        if (!positions)
-            ERR("malloc");
-        for (int i = 0; i < board_size; ++i)
-            positions[i] = i;
-        count = board_size;
-    }
-    if (!count)
+    if (g->log_fd < 0)
+        return;
+    if (munmap(g->log, g->log_cap))
+        ERR("munmap");
+    if (ftruncate(g->log_fd, g->log_len))
+        ERR("ftruncate");
+    if (TEMP_FAILURE_RETRY(close(g->log_fd)))
+        ERR("close");
+    g->log_fd = -1;
+}
+
+room *game_room(int id)
+{
+    return &dir->rooms[id % DIRECTORY_SIZE];
+}
+
+// Claims a slot for a new game of this process and returns its id, or -1
+// if every slot holds a game still waiting or playing. A busy slot is
+// skipped with its id, so one pass over the directory finds a free one.
+// DIRECTORY_SIZE divides INT_MAX + 1, so ids wrap onto the same slots.
+int claim_room(void)
+{
+    for (int i = 0; i < DIRECTORY_SIZE; ++i)
+    {
+        int id = atomic_fetch_add(&dir->next_game, 1) & INT_MAX;
+        room *r = game_room(id);
+        int state = atomic_load(&r->state);
+        if ((state != ROOM_FREE && state != ROOM_OVER) ||
+            !atomic_compare_exchange_strong(&r->state, &state, ROOM_CLAIMED))
+            continue;
+        atomic_store(&r->owner, process_index);
+        atomic_store(&r->players, 0);
+        atomic_store(&r->winner, EMPTY);
+        atomic_store(&r->seats, (uint64_t)id << 32);
+        atomic_store(&r->id, id);
+        atomic_store(&r->state, ROOM_WAITING);
+        return id;
+    }
+    return -1;
+}
+
+// Returns the process owning game id, or -1 if the directory has no such game.
+int room_owner(int id)
+{
+    room *r = game_room(id);
+    if (atomic_load(&r->id) != id)
+        return -1;
+    int owner = atomic_load(&r->owner);
+    // the slot may have been taken by a newer game meanwhile
+    return atomic_load(&r->id) == id ? owner : -1;
+}
+
+void conn_close(conn *c)
+{
+    if (c->source.fd < 0)
+        return;
+    if (TEMP_FAILURE_RETRY(close(c->source.fd)))
+        ERR("close");
+    c->source.fd = -1;
+    buffer_clear(&c->out);
+}
+
+// Watches for input unless the connection is paused, and for room to write
+// while output is buffered.
+void conn_arm(worker *w, conn *c)
+{
+    reactor_modify(&w->reactor, &c->source, (c->paused ? 0 : EPOLLIN) | (c->out.len ? EPOLLOUT : 0));
+}
+
+// Writes as much of the output as the socket takes. Returns -1 if the
+// connection is broken.
+int conn_flush(worker *w, conn *c)
+{
+    if (c->source.fd < 0)
+        return 0;
+    if (buffer_flush(&c->out, c->source.fd) < 0)
         return -1;
-    unsigned seed = time(NULL);
-    int n = rand_r(&seed) % count;
-    int i = positions[n];
-    positions[n] = positions[count - 1];
-    --count;
-    if (!count)
+    conn_arm(w, c);
+    return 0;
+}
+
+void conn_send(worker *w, conn *c, const char *buf, size_t len)
+{
+    if (c->source.fd < 0)
+        return;
+    if (c->out.len > MAX_OUTPUT)
+    {
+        // a connection that stopped reading loses further output
+        c->lagging = 1;
+        return;
+    }
+    buffer_append(&c->out, buf, len);
+    if (!c->dirty)
     {
-        free(positions);
-        positions = NULL;
+        c->dirty = 1;
+        c->next_dirty = w->dirty;
+        w->dirty = c;
     }
-    return i;
 }
 
-void print_board(char *buf, int length, int *board, int board_size)
+void send_player(game *g, int player, char *buf)
 {
-    strncpy(buf, "|", length);
-    char field[3];
-    memset(field, 0, sizeof(field));
-    for (int i = 0; i < board_size; ++i)
+    conn_send(g->worker, &g->data[player].conn, buf, strlen(buf));
+}
+
+// Sends the changes of the last move, or the whole board to a connection
+// that lost some of them, once it has room again.
+void send_update(game *g, conn *c, const char *buf, int len)
+{
+    if (!c->lagging)
     {
-        if (-1 == board[i])
-            strncpy(field, " |", sizeof(field));
-        else
-            snprintf(field, sizeof(field), "%d|", board[i]);
-        strncat(buf, field, length - strlen(buf) - 1);
+        conn_send(g->worker, c, buf, len);
+        return;
     }
-    strncat(buf, "\n", length - strlen(buf) - 1);
+    if (c->out.len > MAX_OUTPUT)
+        return;
+    c->lagging = 0;
+    char head[16];
+    snprintf(head, sizeof(head), "@%u\n", g->version);
+    conn_send(g->worker, c, head, strlen(head));
+    board_view(g);
+    conn_send(g->worker, c, g->view, g->view_len);
 }
 
-void move_player(char *buf, int length, linear *data)
+// Sends the changes of the last move to everybody watching the game.
+void publish(game *g)
 {
+    if (!g->delta_len)
+        return;
+    char buf[MAX_SIZE + 16];
+    int len = snprintf(buf, sizeof(buf), "@%u%s\n", ++g->version, g->delta);
+    if (g->board.size <= MAX_VIEW)
+        g->view_version = g->version;
+    g->delta_len = 0;
+    g->delta[0] = 0;
+    if (push_updates)
+        for (int i = 0; i < g->board.num_players; ++i)
+            send_update(g, &g->data[i].conn, buf, len);
+    for (spectator *s = g->spectators; s; s = s->next)
+        send_update(g, &s->conn, buf, len);
+}
+
+void unlink_game(worker *w, game *g)
+{
+    if (g->prev)
+        g->prev->next = g->next;
+    else
+        w->games = g->next;
+    if (g->next)
+        g->next->prev = g->prev;
+    game **link = &w->table[g->id % GAME_BUCKETS];
+    while (*link != g)
+        link = &(*link)->hnext;
+    *link = g->hnext;
+}
+
+// Closes a player's connection; the game is over once nobody is connected.
+// Its piece stays on the board, as when a player disconnects.
+void drop_player(game *g, int player)
+{
+    conn *c = &g->data[player].conn;
+    if (c->source.fd < 0 && !g->data[player].hung_up)
+        return;
+    g->data[player].hung_up = 0;
+    reactor_cancel(&g->worker->reactor, &g->data[player].resume);
+    conn_flush(g->worker, c);
+    conn_close(c);
+    log_event(g, LOG_LEAVE, player, g->board.positions[player], 0);
+    atomic_store(&game_room(g->id)->players, g->connected - 1);
+    if (--g->connected)
+        return;
+    log_event(g, LOG_END, EMPTY, EMPTY, 0);
+    // the last write to the room, which may be claimed again right after
+    atomic_store(&game_room(g->id)->state, ROOM_OVER);
+    atomic_fetch_add(&dir->finished, 1);
+    worker *w = g->worker;
+    char buf[MAX_SIZE];
+    snprintf(buf, sizeof(buf), "Game#%d is over.\n", g->id);
+    for (spectator *s = g->spectators; s; s = s->next)
+        conn_send(w, &s->conn, buf, strlen(buf));
+    unlink_game(w, g);
+    g->next = w->finished;
+    w->finished = g;
+}
+
+void move_player(char *buf, linear *data)
+{
+    game *g = data->game;
+    int me = data->player_number;
+    char msg[MAX_SIZE];
     int step = strtol(buf, NULL, 10);
     if (step < -2 || step > 2)
         return;
     if (!step)
     {
-        print_board(buf, length, data->board, data->board_size);
-        if (bulk_write(data->socketfds[data->player_number], buf, strlen(buf)) < 0 && errno != EPIPE)
-            ERR("write");
+        board_view(g);
+        conn_send(g->worker, &data->conn, g->view, g->view_len);
+        return;
+    }
+    int position = g->board.positions[me] + step;
+    log_event(g, LOG_MOVE, me, position, step);
+    // leave the old cell unless somebody has already taken it
+    if (board_release(&g->board, g->board.positions[me], me))
+        update_board(g, g->board.positions[me], EMPTY);
+    if (position < 0 || position >= g->board.size)
+    {
+        g->board.positions[me] = EMPTY;
+        atomic_fetch_sub(&g->alive, 1);
+        publish(g);
+        strncpy(msg, "You lost: you stepped out of the board!\n", sizeof(msg));
+        send_player(g, me, msg);
+        drop_player(g, me);
+        return;
+    }
+    // the exchange tells exactly whose piece was captured, if any
+    int victim = board_exchange(&g->board, position, me);
+    update_board(g, position, me);
+    g->board.positions[me] = position;
+    publish(g);
+    if (victim != EMPTY)
+    {
+        g->board.positions[victim] = EMPTY;
+        atomic_fetch_sub(&g->alive, 1);
+        log_event(g, LOG_CAPTURE, victim, position, me);
+        snprintf(msg, sizeof(msg), "You lost: player#%d stepped on you!\n", me);
+        send_player(g, victim, msg);
+        drop_player(g, victim);
+    }
+    if (1 == atomic_load(&g->alive))
+    {
+        log_event(g, LOG_WIN, me, position, 0);
+        atomic_store(&game_room(g->id)->winner, me);
+        strncpy(msg, "You have won!\n", sizeof(msg));
+        send_player(g, me, msg);
+        drop_player(g, me);
+    }
+}
+
+void throttle(worker *w, linear *data, uint64_t resume)
+{
+    data->conn.paused = 1;
+    if (data->conn.source.fd >= 0)
+        conn_arm(w, &data->conn);
+    reactor_timer(&w->reactor, &data->resume, resume);
+}
+
+// Applies the complete lines read from a player, in order, until the player
+// is out of the game or the next move is not due yet.
+void player_commands(linear *data)
+{
+    worker *w = data->game->worker;
+    uint64_t now = w->reactor.now;
+    char *line;
+    while ((data->conn.source.fd >= 0 || data->hung_up) && reader_ready(&data->reader))
+    {
+        if (move_interval && now + move_tolerance < data->due)
+        {
+            throttle(w, data, data->due - move_tolerance);
+            return;
+        }
+        if (!(line = reader_line(&data->reader)))
+            break;
+        if (move_interval)
+            data->due = (data->due > now ? data->due : now) + move_interval;
+        TRACE_BEGIN("move_player");
+        move_player(line, data);
+        TRACE_END("move_player");
+    }
+    // a player that has hung up leaves once its last move is played
+    if (data->hung_up)
+        drop_player(data->game, data->player_number);
+}
+
+// Goes on with a throttled player whose next move is due.
+void resume_player(reactor *r, timer *t)
+{
+    linear *data = container_of(t, linear, resume);
+    if (data->conn.source.fd < 0 && !data->hung_up)
+        return;
+    data->conn.paused = 0;
+    if (data->conn.source.fd >= 0)
+        conn_arm(data->game->worker, &data->conn);
+    player_commands(data);
+}
+
+// Writes pending output if the socket has room. Returns 0 if the event has
+// nothing else to handle.
+int conn_event(worker *w, conn *c, uint32_t *events)
+{
+    if (*events & EPOLLOUT && conn_flush(w, c) < 0)
+        *events |= EPOLLHUP;
+    return *events & (EPOLLIN | EPOLLHUP | EPOLLERR) && c->source.fd >= 0;
+}
+
+// Handles one readiness event of a player's connection.
+void interact_with_player(reactor *r, source *s, uint32_t events)
+{
+    worker *w = container_of(r, worker, reactor);
+    linear *data = container_of(s, linear, conn.source);
+    game *g = data->game;
+    // the connection may have been closed earlier in the same batch of events
+    if (!conn_event(w, &data->conn, &events))
+        return;
+    if (data->conn.paused)
+    {
+        // A throttled player is not read, so this is a hangup or an error.
+        // The moves it sent before are played when they are due, by the
+        // resume timer, and the player is dropped after the last one.
+        while (reader_fill(&data->reader, s->fd) > 0)
+            ;
+        conn_flush(w, &data->conn);
+        conn_close(&data->conn);
+        data->hung_up = 1;
+        return;
+    }
+    int count = reader_fill(&data->reader, s->fd);
+    if (count > 0)
+        player_commands(data);
+    else if (!count || ECONNRESET == errno)
+        drop_player(g, data->player_number);
+    else if (errno != EAGAIN)
+        ERR("read");
+}
+
+void drop_spectator(worker *w, spectator *s)
+{
+    conn_close(&s->conn);
+    if (s->game)
+    {
+        spectator **link = &s->game->spectators;
+        while (*link != s)
+            link = &(*link)->next;
+        *link = s->next;
+        s->game = NULL;
+    }
+    s->next = w->gone;
+    w->gone = s;
+}
+
+// Spectators only talk to unsubscribe by closing the connection.
+void interact_with_spectator(reactor *r, source *src, uint32_t events)
+{
+    worker *w = container_of(r, worker, reactor);
+    spectator *s = container_of(src, spectator, conn.source);
+    if (!conn_event(w, &s->conn, &events))
         return;
+    char buf[MAX_SIZE];
+    int count = TEMP_FAILURE_RETRY(read(src->fd, buf, sizeof(buf)));
+    if (!count || (count < 0 && ECONNRESET == errno))
+        drop_spectator(w, s);
+    else if (count < 0 && errno != EAGAIN)
+        ERR("read");
+}
+
+size_t align_line(size_t size)
+{
+    return (size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+}
+
+// Lays out the arena of a game: the players, the slots, the positions and
+// the view follow the game, each on its own cache lines.
+void plan_arena(int num_players, int board_size)
+{
+    arena.field = snprintf(NULL, 0, "%d", num_players - 1);
+    for (arena.bits = 1; (1 << arena.bits) < 2 * num_players; ++arena.bits)
+        ;
+    size_t view_size = board_size <= MAX_VIEW ? board_size * (arena.field + 1) + 2
+                                              : num_players * (2 * sizeof("-2147483648") + 2) + 16;
+    arena.data = align_line(sizeof(game));
+    arena.slots = arena.data + align_line(num_players * sizeof(linear));
+    arena.positions = arena.slots + align_line(((size_t)1 << arena.bits) * sizeof(uint64_t));
+    arena.view = arena.positions + align_line(num_players * sizeof(int));
+    arena.size = arena.view + view_size;
+}
+
+// Takes a game from the pool, or makes one, and clears it for a new room.
+// The buffers of the players are kept, so a recycled game allocates nothing.
+game *new_game(int id, int num_players, int board_size)
+{
+    game *g = pool_get(&games);
+    char *base = (char *)g;
+    memset(g, 0, sizeof(*g));
+    g->board.size = board_size;
+    g->board.num_players = num_players;
+    g->board.bits = arena.bits;
+    g->field = arena.field;
+    g->data = (linear *)(base + arena.data);
+    g->board.slots = (_Atomic uint64_t *)(base + arena.slots);
+    g->board.positions = (int *)(base + arena.positions);
+    g->view = base + arena.view;
+    g->id = id;
+    g->log_fd = -1;
+    g->board.random = mix_seed(game_seed + id);
+    memset(g->board.slots, 0, ((size_t)1 << g->board.bits) * sizeof(*g->board.slots));
+    for (int i = 0; i < num_players; ++i)
+    {
+        linear *data = &g->data[i];
+        buffer out = data->conn.out, in = data->reader.in;
+        memset(data, 0, sizeof(*data));
+        buffer_clear(&out);
+        buffer_clear(&in);
+        data->conn.out = out;
+        data->conn.source.fd = -1;
+        reader_init(&data->reader, MAX_SIZE);
+        data->reader.in = in;
+        timer_init(&data->resume, resume_player);
     }
-    int position = data->positions[data->player_number] + step;
-    data->board[data->positions[data->player_number]] = -1;
-    if (sem_post(&data->semaphores[data->positions[data->player_number]]))
-        ERR("sem_post");
-    if (position < 0 || position >= data->board_size)
+    return g;
+}
+
+void free_spectator(spectator *s)
+{
+    conn_close(&s->conn);
+    buffer_free(&s->conn.out);
+    free(s);
+}
+
+// Closes what the game still holds and puts it back into the pool.
+void free_game(game *g)
+{
+    for (int i = 0; i < g->board.num_players; ++i)
     {
-        strncpy(buf, "You lost: you stepped out of the board!\n", length);
-        if (bulk_write(data->socketfds[data->player_number], buf, strlen(buf)) < 0 && errno != EPIPE)
+        if (g->worker)
+            reactor_cancel(&g->worker->reactor, &g->data[i].resume);
+        conn_close(&g->data[i].conn);
+    }
+    while (g->spectators)
+    {
+        spectator *s = g->spectators;
+        g->spectators = s->next;
+        free_spectator(s);
+    }
+    log_close(g);
+    pool_put(&games, g);
+}
+
+void release_game(void *block)
+{
+    game *g = block;
+    for (int i = 0; i < g->board.num_players; ++i)
+    {
+        buffer_free(&g->data[i].conn.out);
+        reader_free(&g->data[i].reader);
+    }
+}
+
+// Called by the worker for a game taken from its incoming queue.
+void adopt_game(worker *w, game *g)
+{
+    char buf[MAX_SIZE];
+    g->worker = w;
+    g->prev = NULL;
+    g->next = w->games;
+    if (w->games)
+        w->games->prev = g;
+    w->games = g;
+    g->hnext = w->table[g->id % GAME_BUCKETS];
+    w->table[g->id % GAME_BUCKETS] = g;
+    g->connected = g->board.num_players;
+    print_board(g);
+    if (log_directory)
+        log_open(g);
+    for (int i = 0; i < g->board.num_players; ++i)
+        log_event(g, LOG_PLACE, i, g->board.positions[i], 0);
+    for (int i = 0; i < g->board.num_players; ++i)
+    {
+        conn *c = &g->data[i].conn;
+        set_nonblocking(c->source.fd);
+        reactor_add(&w->reactor, &c->source, c->source.fd, EPOLLIN, interact_with_player);
+        strncpy(buf, "The game has started.\n", sizeof(buf));
+        send_player(g, i, buf);
+        conn_send(w, c, g->view, g->view_len);
+    }
+}
+
+game *find_game(worker *w, int id)
+{
+    game *g = w->table[id % GAME_BUCKETS];
+    while (g && g->id != id)
+        g = g->hnext;
+    return g;
+}
+
+void adopt_spectator(worker *w, spectator *s)
+{
+    char buf[MAX_SIZE];
+    game *g = find_game(w, s->game_id);
+    if (!g)
+    {
+        snprintf(buf, sizeof(buf), "There is no game#%d.\n", s->game_id);
+        if (bulk_write(s->conn.source.fd, buf, strlen(buf)) < 0 && errno != EPIPE && errno != ECONNRESET &&
+            errno != EAGAIN)
             ERR("write");
-        if (TEMP_FAILURE_RETRY(close(data->socketfds[data->player_number])))
+        free_spectator(s);
+        return;
+    }
+    s->game = g;
+    s->next = g->spectators;
+    g->spectators = s;
+    reactor_add(&w->reactor, &s->conn.source, s->conn.source.fd, EPOLLIN, interact_with_spectator);
+    snprintf(buf, sizeof(buf), "@%u\n", g->version);
+    conn_send(w, &s->conn, buf, strlen(buf));
+    board_view(g);
+    conn_send(w, &s->conn, g->view, g->view_len);
+}
+
+void take_incoming(reactor *r, source *src, uint32_t events)
+{
+    worker *w = container_of(r, worker, reactor);
+    uint64_t value;
+    if (read(src->fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        ERR("read");
+    if (!do_work)
+    {
+        reactor_stop(r);
+        return;
+    }
+    pthread_mutex_lock(&w->mutex);
+    game *g = w->incoming;
+    spectator *s = w->incoming_spectators;
+    w->incoming = NULL;
+    w->incoming_spectators = NULL;
+    pthread_mutex_unlock(&w->mutex);
+    while (g)
+    {
+        game *next = g->next;
+        adopt_game(w, g);
+        g = next;
+    }
+    while (s)
+    {
+        spectator *next = s->next;
+        adopt_spectator(w, s);
+        s = next;
+    }
+}
+
+// Writes what the batch has sent and frees what it has closed.
+void end_batch(reactor *r)
+{
+    worker *w = container_of(r, worker, reactor);
+    TRACE_BEGIN("flush");
+    while (w->dirty)
+    {
+        conn *c = w->dirty;
+        w->dirty = c->next_dirty;
+        c->dirty = 0;
+        if (conn_flush(w, c) < 0)
+            conn_close(c);
+    }
+    TRACE_END("flush");
+    while (w->finished)
+    {
+        game *g = w->finished;
+        w->finished = g->next;
+        free_game(g);
+    }
+    while (w->gone)
+    {
+        spectator *s = w->gone;
+        w->gone = s->next;
+        free_spectator(s);
+    }
+}
+
+void *worker_loop(void *ptr)
+{
+    worker *w = (worker *)ptr;
+    reactor_run(&w->reactor);
+    while (w->games)
+    {
+        game *g = w->games;
+        w->games = g->next;
+        free_game(g);
+    }
+    for (game *g = w->incoming; g; g = w->incoming)
+    {
+        w->incoming = g->next;
+        free_game(g);
+    }
+    for (spectator *s = w->incoming_spectators; s; s = w->incoming_spectators)
+    {
+        w->incoming_spectators = s->next;
+        free_spectator(s);
+    }
+    return NULL;
+}
+
+void wake_worker(worker *w)
+{
+    uint64_t one = 1;
+    if (write(w->wake.fd, &one, sizeof(one)) < 0)
+        ERR("write");
+}
+
+void start_workers(worker *workers, int num_workers)
+{
+    for (int i = 0; i < num_workers; ++i)
+    {
+        worker *w = &workers[i];
+        memset(w, 0, sizeof(*w));
+        reactor_init(&w->reactor);
+        w->reactor.after_batch = end_batch;
+        int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd < 0)
+            ERR("eventfd");
+        reactor_add(&w->reactor, &w->wake, fd, EPOLLIN, take_incoming);
+        if (pthread_mutex_init(&w->mutex, NULL))
+            ERR("pthread_mutex_init");
+        if (pthread_create(&w->thread, NULL, worker_loop, w))
+            ERR("pthread_create");
+    }
+}
+
+void stop_workers(worker *workers, int num_workers)
+{
+    for (int i = 0; i < num_workers; ++i)
+        wake_worker(&workers[i]);
+    for (int i = 0; i < num_workers; ++i)
+    {
+        worker *w = &workers[i];
+        if (pthread_join(w->thread, NULL))
+            ERR("pthread_join");
+        if (TEMP_FAILURE_RETRY(close(w->wake.fd)))
             ERR("close");
-        pthread_exit(NULL);
+        reactor_destroy(&w->reactor);
+        pthread_mutex_destroy(&w->mutex);
+    }
+}
+
+// Places the players of a full room and hands the game over to the worker
+// owning its id, so the lobby can go back to accepting connections immediately.
+void start_game(game *g, worker *workers, int num_workers)
+{
+    atomic_init(&g->alive, g->board.num_players);
+    place_players(&g->board);
+    for (int i = 0; i < g->board.num_players; ++i)
+    {
+        g->data[i].game = g;
+        g->data[i].player_number = i;
     }
-    if (sem_trywait(&data->semaphores[position]))
+    atomic_store(&game_room(g->id)->state, ROOM_PLAYING);
+    atomic_fetch_add(&dir->started, 1);
+    worker *w = &workers[g->id % num_workers];
+    pthread_mutex_lock(&w->mutex);
+    g->next = w->incoming;
+    w->incoming = g;
+    pthread_mutex_unlock(&w->mutex);
+    wake_worker(w);
+}
+
+// Hands a spectator that named its game over to the worker owning that game.
+void watch_game(spectator *s, worker *workers, int num_workers)
+{
+    worker *w = &workers[s->game_id % num_workers];
+    pthread_mutex_lock(&w->mutex);
+    s->next = w->incoming_spectators;
+    w->incoming_spectators = s;
+    pthread_mutex_unlock(&w->mutex);
+    wake_worker(w);
+}
+
+// The lobby seats its players in the open room of the directory, fills the
+// rooms it owns and waits for the game numbers spectators are about to send.
+typedef struct
+{
+    reactor reactor;
+    source players, spectators;
+    worker *workers;
+    int num_workers;
+    source handoff;  // players and spectators handed over by the other processes
+    game *rooms;     // the rooms of this process still filling up
+    int num_players, board_size;
+} lobby;
+
+enum handoff_kind
+{
+    HANDOFF_SPECTATOR,
+    HANDOFF_PLAYER
+};
+
+// Sent along with the descriptor of a connection handed over.
+typedef struct
+{
+    int kind;
+    int game_id;
+    int seat;
+} handoff_msg;
+
+// Opens a room of this process as the one taking players, unless another
+// process has just opened one. Returns 0 if the directory is full.
+int open_room(lobby *l)
+{
+    int id = claim_room();
+    if (id < 0)
+        return 0;
+    int none = -1;
+    if (!atomic_compare_exchange_strong(&dir->open, &none, id))
     {
-        if (EAGAIN == errno)
+        atomic_store(&game_room(id)->state, ROOM_FREE);
+        return 1;
+    }
+    game *g = new_game(id, l->num_players, l->board_size);
+    g->next = l->rooms;
+    l->rooms = g;
+    return 1;
+}
+
+// Takes the next seat of the open room, whichever process owns it, and
+// returns the room, or -1 if no room can be opened. Whoever takes the
+// last seat closes the room, so the next player opens another one.
+int claim_seat(lobby *l, int *seat)
+{
+    for (;;)
+    {
+        int id = atomic_load(&dir->open);
+        if (id < 0)
         {
-            snprintf(buf, length, "You lost: player#%d stepped on you!\n", data->player_number);
-            if (bulk_write(data->socketfds[data->board[position]], buf, strlen(buf)) < 0 && errno != EPIPE)
-                ERR("write");
-            if (TEMP_FAILURE_RETRY(close(data->socketfds[data->board[position]])))
-                ERR("close");
-            if (pthread_cancel(data->threads[data->board[position]]))
-                ERR("pthread_cancel");
+            if (!open_room(l))
+                return -1;
+            continue;
         }
-        else
-            ERR("sem_trywait");
-    }
-    data->positions[data->player_number] = position;
-    data->board[data->positions[data->player_number]] = data->player_number;
-    int count = 0;
-    for (int i = 0; i < data->board_size; ++i)
-        if (data->board[i] != -1)
-            ++count;
-    if (count == 1)
-    {
-        strncpy(buf, "You have won!\n", length);
-        if (bulk_write(data->socketfds[data->player_number], buf, strlen(buf)) < 0 && errno != EPIPE)
-            ERR("write");
-        if (TEMP_FAILURE_RETRY(close(data->socketfds[data->player_number])))
+        room *r = game_room(id);
+        uint64_t seats = atomic_load(&r->seats);
+        *seat = (uint32_t)seats;
+        if (seats >> 32 != (uint64_t)id || *seat >= l->num_players)
+        {
+            // full, and about to be closed by the last player
+            atomic_compare_exchange_strong(&dir->open, &id, -1);
+            continue;
+        }
+        if (!atomic_compare_exchange_weak(&r->seats, &seats, seats + 1))
+            continue;
+        if (*seat + 1 == l->num_players)
+            atomic_compare_exchange_strong(&dir->open, &id, -1);
+        return id;
+    }
+}
+
+// Seats a player in a room of this process and starts the game once full.
+void seat_player(lobby *l, int id, int seat, int fd)
+{
+    game **link = &l->rooms;
+    while (*link && (*link)->id != id)
+        link = &(*link)->next;
+    game *g = *link;
+    if (!g)
+    {
+        // a room of a lobby that has stopped
+        if (TEMP_FAILURE_RETRY(close(fd)))
+            ERR("close");
+        return;
+    }
+    g->data[seat].conn.source.fd = fd;
+    atomic_store(&game_room(id)->players, ++g->connected);
+    if (g->connected < l->num_players)
+        return;
+    *link = g->next;
+    start_game(g, l->workers, l->num_workers);
+}
+
+// Takes one player or spectator handed over by another process; returns 0
+// once there is none left.
+int receive_handoff(lobby *l)
+{
+    handoff_msg m;
+    int fd;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {&m, sizeof(m)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+    ssize_t count = TEMP_FAILURE_RETRY(recvmsg(handoff_in, &msg, MSG_CMSG_CLOEXEC));
+    if (count < 0)
+    {
+        if (EAGAIN == errno)
+            return 0;
+        ERR("recvmsg");
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS)
+        return 1;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    if (count != sizeof(m))
+    {
+        if (TEMP_FAILURE_RETRY(close(fd)))
             ERR("close");
-        pthread_exit(NULL);
+        return 1;
     }
+    if (HANDOFF_PLAYER == m.kind)
+    {
+        seat_player(l, m.game_id, m.seat, fd);
+        return 1;
+    }
+    spectator *s = calloc(1, sizeof(*s));
+    if (!s)
+        ERR("calloc");
+    s->conn.source.fd = fd;
+    s->game_id = m.game_id;
+    set_nonblocking(fd);
+    watch_game(s, l->workers, l->num_workers);
+    return 1;
+}
+
+void receive_handoffs(reactor *r, source *src, uint32_t events)
+{
+    lobby *l = container_of(r, lobby, reactor);
+    while (receive_handoff(l))
+        ;
 }
 
-void *interact_with_player(void *ptr)
+// Sends a connection to the process playing its game, which takes it as
+// if it had connected there. A spectator it cannot take right now is
+// dropped, but a player already has a seat there and waits for room,
+// taking in what is handed over to this process meanwhile, so two lobbies
+// handing over to each other never both wait.
+void hand_over(lobby *l, int owner, handoff_msg *m, int fd)
 {
-    linear *data = (linear *)ptr;
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {m, sizeof(*m)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    while (TEMP_FAILURE_RETRY(sendmsg(handoffs[owner], &msg, MSG_DONTWAIT)) < 0)
+    {
+        if (errno != EAGAIN)
+            ERR("sendmsg");
+        if (HANDOFF_SPECTATOR == m->kind)
+            return;
+        while (receive_handoff(l))
+            ;
+        struct pollfd pfd = {.fd = handoffs[owner], .events = POLLOUT};
+        if (TEMP_FAILURE_RETRY(poll(&pfd, 1, 1)) < 0)
+            ERR("poll");
+    }
+}
+
+void lobby_spectator(reactor *r, source *src, uint32_t events)
+{
+    lobby *l = container_of(r, lobby, reactor);
+    spectator *s = container_of(src, spectator, conn.source);
     char buf[MAX_SIZE];
-    memset(buf, 0, sizeof(buf));
-    strncpy(buf, "The game has started.\n", sizeof(buf));
-    if (bulk_write(data->socketfds[data->player_number], buf, strlen(buf)) < 0 && errno != EPIPE)
-        ERR("write");
-    print_board(buf, sizeof(buf), data->board, data->board_size);
-    if (bulk_write(data->socketfds[data->player_number], buf, strlen(buf)) < 0 && errno != EPIPE)
+    int count = TEMP_FAILURE_RETRY(read(src->fd, buf, sizeof(buf) - 1));
+    if (count < 0 && EAGAIN == errno)
+        return;
+    reactor_remove(r, src);
+    if (count <= 0 || (buf[count] = 0, (s->game_id = strtol(buf, NULL, 10)) < 0))
+    {
+        free_spectator(s);
+        return;
+    }
+    int owner = room_owner(s->game_id);
+    if (owner >= 0 && owner != process_index)
+    {
+        handoff_msg m = {HANDOFF_SPECTATOR, s->game_id, 0};
+        hand_over(l, owner, &m, s->conn.source.fd);
+        free_spectator(s);
+    }
+    else
+        watch_game(s, l->workers, l->num_workers);
+}
+
+void accept_spectator(reactor *r, source *src, uint32_t events)
+{
+    int sock = add_new_client(src->fd);
+    if (sock < 0)
+        return;
+    spectator *s = calloc(1, sizeof(*s));
+    if (!s)
+        ERR("calloc");
+    set_nonblocking(sock);
+    reactor_add(r, &s->conn.source, sock, EPOLLIN, lobby_spectator);
+}
+
+void accept_player(reactor *r, source *src, uint32_t events)
+{
+    lobby *l = container_of(r, lobby, reactor);
+    char buf[MAX_SIZE];
+    int sock = add_new_client(src->fd);
+    if (sock < 0)
+        return;
+    int seat, id = claim_seat(l, &seat);
+    if (id < 0)
+        snprintf(buf, sizeof(buf), "All %d games are taken, try again later.\n", DIRECTORY_SIZE);
+    else
+        snprintf(buf, sizeof(buf), "You are player#%d in game#%d. Please wait...\n", seat, id);
+    if (bulk_write(sock, buf, strlen(buf)) < 0 && errno != EPIPE)
         ERR("write");
-    while (do_work)
-    {
-        int count = TEMP_FAILURE_RETRY(read(data->socketfds[data->player_number], buf, sizeof(buf)));
-        if (count > 0)
-            move_player(buf, sizeof(buf), data);
-        else if (count < 0)
-            ERR("read");
-        else
-            break;
+    if (id < 0)
+    {
+        if (TEMP_FAILURE_RETRY(close(sock)))
+            ERR("close");
+        return;
     }
-    if (TEMP_FAILURE_RETRY(close(data->socketfds[data->player_number])))
+    // the room stays listed until its game is over, which needs this player
+    int owner = room_owner(id);
+    if (owner == process_index)
+    {
+        seat_player(l, id, seat, sock);
+        return;
+    }
+    handoff_msg m = {HANDOFF_PLAYER, id, seat};
+    hand_over(l, owner, &m, sock);
+    if (TEMP_FAILURE_RETRY(close(sock)))
         ERR("close");
-    return NULL;
 }
 
-void do_server(int socketfd, int num_players, int board_size)
+void stop_lobby(reactor *r, int sig)
+{
+    do_work = 0;
+    reactor_stop(r);
+}
+
+void do_server(int socketfd, int spectator_socket, int num_players, int board_size, int num_workers)
 {
-    linear *data = malloc(num_players * sizeof(*data));
-    int *board = malloc(board_size * sizeof(*board));
-    int *positions = malloc(num_players * sizeof(*positions));
-    sem_t *semaphores = malloc(board_size * sizeof(*semaphores));
-    int *socketfds = malloc(num_players * sizeof(*socketfds));
-    pthread_t *threads = malloc(num_players * sizeof(*threads));
-    if (!(data && board && positions && semaphores && socketfds && threads))
+    lobby l;
+    memset(&l, 0, sizeof(l));
+    l.num_players = num_players;
+    l.board_size = board_size;
+    l.num_workers = num_workers;
+    reactor_init(&l.reactor);
+    // the workers start with SIGINT blocked, so only the lobby handles it
+    reactor_signal(&l.reactor, SIGINT, stop_lobby);
+
+    plan_arena(num_players, board_size);
+    pool_init(&games, arena.size, 1);
+    if (!(l.workers = malloc(num_workers * sizeof(*l.workers))))
         ERR("malloc");
+    start_workers(l.workers, num_workers);
 
-    char buf[MAX_SIZE];
-    memset(buf, 0, sizeof(buf));
-    sigset_t mask;
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGINT);
-    sigset_t old_mask;
-    sigprocmask(SIG_BLOCK, &mask, &old_mask);
-    fd_set readfds;
-
-    while (do_work)
-    {
-        int index = 0;
-        while (do_work && index < num_players)
+    reactor_add(&l.reactor, &l.players, socketfd, EPOLLIN, accept_player);
+    if (spectator_socket >= 0)
+        reactor_add(&l.reactor, &l.spectators, spectator_socket, EPOLLIN, accept_spectator);
+    if (handoff_in >= 0)
+        reactor_add(&l.reactor, &l.handoff, handoff_in, EPOLLIN, receive_handoffs);
+    reactor_run(&l.reactor);
+
+    // spectators still in the lobby are only reachable through epoll
+    // and are closed with the process
+    reactor_destroy(&l.reactor);
+    while (l.rooms)
+    {
+        game *g = l.rooms;
+        l.rooms = g->next;
+        free_game(g);
+    }
+    stop_workers(l.workers, num_workers);
+    free(l.workers);
+    pool_destroy(&games, release_game);
+}
+
+void open_directory(void)
+{
+    if ((dir = mmap(NULL, sizeof(*dir), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+        ERR("mmap");
+    for (int i = 0; i < DIRECTORY_SIZE; ++i)
+        atomic_init(&dir->rooms[i].id, -1);
+    atomic_init(&dir->open, -1);
+}
+
+void serve(int port_number, int spectator_port, int num_players, int board_size, int num_workers)
+{
+    int (*bind_socket)(uint16_t, int, int) = num_processes > 1 ? bind_shared_inet_socket : bind_inet_socket;
+    int socketfd = bind_socket(port_number, SOCK_STREAM | SOCK_NONBLOCK, SOMAXCONN);
+    int spectator_socket = spectator_port < 0 ? -1 : bind_socket(spectator_port, SOCK_STREAM | SOCK_NONBLOCK, SOMAXCONN);
+    do_server(socketfd, spectator_socket, num_players, board_size, num_workers);
+    if (TEMP_FAILURE_RETRY(close(socketfd)))
+        ERR("close");
+    if (spectator_socket >= 0 && TEMP_FAILURE_RETRY(close(spectator_socket)))
+        ERR("close");
+}
+
+pid_t children[MAX_PROCESSES];
+
+void forward_signal(int sig)
+{
+    for (int i = 0; i < num_processes; ++i)
+        if (children[i] > 0)
+            kill(children[i], sig);
+}
+
+// Keeps a process on its own share of the cores, next to its workers.
+void pin_process(int num_workers)
+{
+    int cores = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int i = 0; i < num_workers; ++i)
+        CPU_SET((process_index * num_workers + i) % cores, &cpus);
+    // only a hint, a restricted cpuset may refuse it
+    sched_setaffinity(0, sizeof(cpus), &cpus);
+}
+
+// Starts a server process per share of the cores. Each one accepts on its
+// own socket bound with SO_REUSEPORT, seats its players in the open room
+// of the game directory and hands them, and spectators, to the process
+// owning their game, which plays it with its own workers. The children have a
+// process group of their own, so SIGINT reaches them through the parent.
+void prefork(int port_number, int spectator_port, int num_players, int board_size, int num_workers)
+{
+    int pairs[MAX_PROCESSES][2];
+    if (!(handoffs = malloc(num_processes * sizeof(*handoffs))))
+        ERR("malloc");
+    for (int i = 0; i < num_processes; ++i)
+    {
+        if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, pairs[i]))
+            ERR("socketpair");
+        handoffs[i] = pairs[i][1];
+    }
+    set_handler(forward_signal, SIGINT);
+    for (int i = 0; i < num_processes; ++i)
+        switch (children[i] = fork())
         {
-            FD_ZERO(&readfds);
-            FD_SET(socketfd, &readfds);
-            if (pselect(socketfd + 1, &readfds, NULL, NULL, NULL, &old_mask) > 0)
-            {
-                int sock = add_new_client(socketfd);
-                if (sock >= 0)
-                {
-                    socketfds[index] = sock;
-                    snprintf(buf, sizeof(buf), "You are player#%d. Please wait...\n", index);
-                    if (bulk_write(socketfds[index], buf, strlen(buf)) < 0 && errno != EPIPE)
-                        ERR("write");
-                    ++index;
-                }
-            }
-            else
-            {
-                if (EINTR == errno)
-                    continue;
-                ERR("pselect");
-            }
+        case -1:
+            ERR("fork");
+        case 0:
+            setpgid(0, 0);
+            if (prctl(PR_SET_PDEATHSIG, SIGINT))
+                ERR("prctl");
+            set_handler(SIG_DFL, SIGINT);
+            process_index = i;
+            handoff_in = pairs[i][0];
+            set_nonblocking(handoff_in);
+            for (int j = 0; j < num_processes; ++j)
+                if (j != i && TEMP_FAILURE_RETRY(close(pairs[j][0])))
+                    ERR("close");
+            pin_process(num_workers);
+            serve(port_number, spectator_port, num_players, board_size, num_workers);
+            exit(EXIT_SUCCESS);
         }
-        sigprocmask(SIG_UNBLOCK, &mask, NULL);
-        if (do_work)
+    for (int i = 0; i < num_processes; ++i)
+        if (TEMP_FAILURE_RETRY(close(pairs[i][0])) || TEMP_FAILURE_RETRY(close(pairs[i][1])))
+            ERR("close");
+    for (;;)
+        if (wait(NULL) < 0)
         {
-            for (int i = 0; i < board_size; ++i)
-            {
-                board[i] = -1;
-                if (sem_init(&semaphores[i], 0, 1))
-                    ERR("sem_init");
-            }
-            for (int i = 0; i < num_players; ++i)
-            {
-                if (!i)
-                    positions[i] = my_random(board_size);
-                else
-                    positions[i] = my_random(-1);
-                if (sem_wait(&semaphores[positions[i]]))
-                    ERR("sem_wait");
-                board[positions[i]] = i;
-            }
-            for (int i = 0; i < num_players; ++i)
-            {
-                data[i].board = board;
-                data[i].board_size = board_size;
-                data[i].num_players = num_players;
-                data[i].player_number = i;
-                data[i].positions = positions;
-                data[i].semaphores = semaphores;
-                data[i].socketfds = socketfds;
-                data[i].threads = threads;
-            }
-            for (int i = 0; i < num_players; ++i)
-                if (pthread_create(&threads[i], NULL, interact_with_player, &data[i]))
-                    ERR("pthread_create");
-            for (int i = 0; i < num_players; ++i)
-                if (pthread_join(threads[i], NULL))
-                    ERR("phtread_join");
-            for (int i = 0; i < board_size; ++i)
-                if (sem_destroy(&semaphores[i]))
-                    ERR("sem_destroy");
+            if (EINTR == errno)
+                continue;
+            if (ECHILD == errno)
+                break;
+            ERR("wait");
         }
-    }
-
-    free(data);
-    free(board);
-    free(positions);
-    free(semaphores);
-    free(socketfds);
-    free(threads);
+    printf("%ld games started, %ld finished, by %d processes\n", atomic_load(&dir->started),
+           atomic_load(&dir->finished), num_processes);
+    free(handoffs);
 }
 
 int main(int argc, char *argv[])
 {
-    if (argc != 4)
+    int num_workers = 0;
+    int spectator_port = -1;
+    int c;
+    double rate = 0;
+    int burst = 1;
+    while ((c = getopt(argc, argv, "w:s:ur:b:l:p:")) != -1)
+        switch (c)
+        {
+        case 'p':
+            num_processes = strtol(optarg, NULL, 10);
+            break;
+        case 'w':
+            num_workers = strtol(optarg, NULL, 10);
+            break;
+        case 's':
+            spectator_port = strtol(optarg, NULL, 10);
+            break;
+        case 'u':
+            push_updates = 1;
+            break;
+        case 'r':
+            rate = strtod(optarg, NULL);
+            break;
+        case 'b':
+            burst = strtol(optarg, NULL, 10);
+            break;
+        case 'l':
+            log_directory = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    if (argc - optind != 3 || num_workers < 0 || rate < 0 || burst < 1 || num_processes < 1 ||
+        num_processes > MAX_PROCESSES)
         usage(argv[0]);
-    int port_number = strtol(argv[1], NULL, 10);
-    int num_players = strtol(argv[2], NULL, 10);
-    int board_size = strtol(argv[3], NULL, 10);
+    if (!num_workers)
+    {
+        num_workers = sysconf(_SC_NPROCESSORS_ONLN) / num_processes;
+        if (num_workers < 1)
+            num_workers = 1;
+    }
+    if (rate > 0)
+    {
+        move_interval = 1e9 / rate;
+        move_tolerance = (burst - 1) * move_interval;
+    }
+    int port_number = strtol(argv[optind], NULL, 10);
+    int num_players = strtol(argv[optind + 1], NULL, 10);
+    int board_size = strtol(argv[optind + 2], NULL, 10);
     verify_args(num_players, board_size);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    game_seed = mix_seed(now.tv_sec * 1000000000ULL + now.tv_nsec) ^ getpid();
     set_handler(SIG_IGN, SIGPIPE);
-    set_handler(sigint_handler, SIGINT);
-    int socketfd = bind_tcp_socket(port_number);
-    do_server(socketfd, num_players, board_size);
-    if (TEMP_FAILURE_RETRY(close(socketfd)))
-        ERR("close");
+    open_directory();
+    if (num_processes > 1)
+        prefork(port_number, spectator_port, num_players, board_size, num_workers);
+    else
+        serve(port_number, spectator_port, num_players, board_size, num_workers);
+    munmap(dir, sizeof(*dir));
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,299 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "game.h"
+#include "util.h"
+
+// Board rebuilt from a log. After a move, the capture and the win it
+// causes are expected to follow in the log.
+typedef struct
+{
+    board board;
+    char *left;  // the player's connection is closed
+    int alive;
+    int connected;
+    int mover;   // player of the last move
+    int victim;  // captured by the last move, EMPTY once logged
+    int win_due;
+    int winner;
+    int ended;
+} game;
+
+const char *type_names[] = {"place", "move", "capture", "win", "leave", "end"};
+
+void usage(char *name)
+{
+    fprintf(stderr, "USAGE: %s [-v] [-n repeat] log_file...\n", name);
+    fprintf(stderr, "checks every game log of linear -l against the rules and times the replay;\n");
+    fprintf(stderr, "-v prints the events, -n replays every log that many times\n");
+    exit(EXIT_FAILURE);
+}
+
+void new_game(game *g, const log_header *header)
+{
+    memset(g, 0, sizeof(*g));
+    g->board.size = header->board_size;
+    g->board.num_players = header->num_players;
+    for (g->board.bits = 1; (1 << g->board.bits) < 2 * g->board.num_players; ++g->board.bits)
+        ;
+    g->board.slots = calloc((size_t)1 << g->board.bits, sizeof(*g->board.slots));
+    g->board.positions = malloc(g->board.num_players * sizeof(*g->board.positions));
+    g->left = malloc(g->board.num_players);
+    if (!(g->board.slots && g->board.positions && g->left))
+        ERR("malloc");
+}
+
+// Puts the players where the generator of the game put them.
+void reset_game(game *g, const log_header *header)
+{
+    memset(g->board.slots, 0, ((size_t)1 << g->board.bits) * sizeof(*g->board.slots));
+    memset(g->left, 0, g->board.num_players);
+    g->board.random = header->random;
+    g->alive = g->connected = g->board.num_players;
+    g->mover = g->victim = g->winner = EMPTY;
+    g->win_due = g->ended = 0;
+    place_players(&g->board);
+}
+
+void free_game(game *g)
+{
+    free(g->board.slots);
+    free(g->board.positions);
+    free(g->left);
+}
+
+// Checks that the last move has been followed by what it caused.
+const char *move_settled(game *g)
+{
+    if (g->victim != EMPTY)
+        return "the capture of the last move is missing";
+    if (g->win_due)
+        return "the win of the last move is missing";
+    return NULL;
+}
+
+// Applies one record. Returns what is wrong with it, or NULL.
+const char *apply(game *g, const log_record *r, int places)
+{
+    int p = r->player;
+    if (r->type != LOG_END && (p < 0 || p >= g->board.num_players))
+        return "no such player";
+    if (g->ended)
+        return "event after the end of the game";
+    switch (r->type)
+    {
+    case LOG_PLACE:
+        if (p != places || r->cell != g->board.positions[p])
+            return "placement differs from the generator";
+        return NULL;
+    case LOG_MOVE:
+    {
+        const char *error = move_settled(g);
+        if (error)
+            return error;
+        if (g->board.positions[p] == EMPTY || g->left[p])
+            return "move of a player off the board";
+        if (r->other < -2 || r->other > 2 || !r->other || r->cell != g->board.positions[p] + r->other)
+            return "move does not match the position";
+        g->mover = p;
+        board_release(&g->board, g->board.positions[p], p);
+        if (r->cell < 0 || r->cell >= g->board.size)
+        {
+            g->board.positions[p] = EMPTY;
+            --g->alive;
+            return NULL;
+        }
+        g->victim = board_exchange(&g->board, r->cell, p);
+        g->board.positions[p] = r->cell;
+        if (g->victim != EMPTY)
+        {
+            g->board.positions[g->victim] = EMPTY;
+            --g->alive;
+        }
+        g->win_due = 1 == g->alive;
+        return NULL;
+    }
+    case LOG_CAPTURE:
+        if (p != g->victim || r->other != g->mover || r->cell != g->board.positions[g->mover])
+            return "capture that the last move did not make";
+        g->victim = EMPTY;
+        return NULL;
+    case LOG_WIN:
+        if (!g->win_due || g->victim != EMPTY || p != g->mover)
+            return "win that the last move did not make";
+        g->win_due = 0;
+        g->winner = p;
+        return NULL;
+    case LOG_LEAVE:
+        if (g->left[p])
+            return "player left twice";
+        g->left[p] = 1;
+        --g->connected;
+        return NULL;
+    case LOG_END:
+        if (g->connected)
+            return "end while players are connected";
+        g->ended = 1;
+        return move_settled(g);
+    }
+    return "unknown event";
+}
+
+void print_record(const log_header *header, const log_record *r)
+{
+    printf("%12.3fms #%llu %s", (r->time - header->monotonic) / 1e6, (unsigned long long)r->seq,
+           r->type >= LOG_PLACE && r->type <= LOG_END ? type_names[r->type] : "?");
+    switch (r->type)
+    {
+    case LOG_PLACE:
+    case LOG_WIN:
+        printf(" player#%d cell %d\n", r->player, r->cell);
+        break;
+    case LOG_MOVE:
+        printf(" player#%d by %d to %d\n", r->player, r->other, r->cell);
+        break;
+    case LOG_CAPTURE:
+        printf(" player#%d on %d by player#%d\n", r->player, r->cell, r->other);
+        break;
+    case LOG_LEAVE:
+        printf(" player#%d\n", r->player);
+        break;
+    default:
+        printf("\n");
+    }
+}
+
+// Replays one log. Returns the number of records, or -1 if the log breaks the rules.
+long replay(const char *path, game *g, const log_header *header, const log_record *records, size_t count, int verbose)
+{
+    reset_game(g, header);
+    uint64_t time = header->monotonic;
+    int places = 0;
+    size_t i;
+    for (i = 0; i < count && records[i].seq; ++i)
+    {
+        const log_record *r = &records[i];
+        if (verbose)
+            print_record(header, r);
+        const char *error = r->seq != i + 1 ? "sequence number out of order"
+                            : r->time < time ? "time goes backwards"
+                                             : apply(g, r, places);
+        if (error)
+        {
+            fprintf(stderr, "%s: event #%llu: %s\n", path, (unsigned long long)r->seq, error);
+            return -1;
+        }
+        time = r->time;
+        places += LOG_PLACE == r->type;
+    }
+    if (places != g->board.num_players)
+    {
+        fprintf(stderr, "%s: %d of %d players placed\n", path, places, g->board.num_players);
+        return -1;
+    }
+    return i;
+}
+
+// Replays a log file repeat times. Returns the number of records replayed,
+// or -1 if the file is not a valid log.
+long replay_file(const char *path, int repeat, int verbose)
+{
+    int fd = TEMP_FAILURE_RETRY(open(path, O_RDONLY | O_CLOEXEC));
+    if (fd < 0)
+    {
+        perror(path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st))
+        ERR("fstat");
+    if ((size_t)st.st_size < sizeof(log_header))
+    {
+        fprintf(stderr, "%s: not a game log\n", path);
+        TEMP_FAILURE_RETRY(close(fd));
+        return -1;
+    }
+    char *log = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (MAP_FAILED == log)
+        ERR("mmap");
+    if (TEMP_FAILURE_RETRY(close(fd)))
+        ERR("close");
+    log_header header;
+    memcpy(&header, log, sizeof(header));
+    if (header.magic != LOG_MAGIC || header.version != LOG_VERSION || header.num_players < 2 ||
+        header.board_size < header.num_players)
+    {
+        fprintf(stderr, "%s: not a game log\n", path);
+        munmap(log, st.st_size);
+        return -1;
+    }
+    const log_record *records = (const log_record *)(log + sizeof(header));
+    size_t count = (st.st_size - sizeof(header)) / sizeof(log_record);
+    game g;
+    new_game(&g, &header);
+    long events = replay(path, &g, &header, records, count, verbose);
+    if (events >= 0)
+    {
+        printf("%s: game#%d, %d players, board %d, %ld events, ", path, header.game_id, g.board.num_players,
+               g.board.size, events);
+        if (g.winner != EMPTY)
+            printf("player#%d won", g.winner);
+        else
+            printf("no winner");
+        printf("%s\n", g.ended ? "" : ", not finished");
+        for (int i = 1; i < repeat; ++i)
+            replay(path, &g, &header, records, count, 0);
+        events *= repeat;
+    }
+    free_game(&g);
+    if (munmap(log, st.st_size))
+        ERR("munmap");
+    return events;
+}
+
+int main(int argc, char *argv[])
+{
+    int verbose = 0;
+    int repeat = 1;
+    int c;
+    while ((c = getopt(argc, argv, "vn:")) != -1)
+        switch (c)
+        {
+        case 'v':
+            verbose = 1;
+            break;
+        case 'n':
+            repeat = strtol(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    if (optind == argc || repeat < 1)
+        usage(argv[0]);
+    long total = 0;
+    int failed = 0;
+    uint64_t start = now_ns();
+    for (int i = optind; i < argc; ++i)
+    {
+        long events = replay_file(argv[i], repeat, verbose);
+        if (events < 0)
+            ++failed;
+        else
+            total += events;
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    printf("%d logs, %d broken, %ld events replayed in %.3fs (%.0f events/s)\n", argc - optind, failed, total,
+           elapsed, elapsed > 0 ? total / elapsed : 0);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}